@@ -34,8 +34,8 @@
 #define PAGESIZE	4096
 #define ELFHDR		((struct Elf *) 0x10000) // scratch space
 
-void readsect(void *addr, uint32_t sectornum);
-void readseg(uint32_t va, uint32_t filesz, uint32_t memsz, uint32_t offset);
+static void readsects(uint8_t *dst, uint32_t lba, uint32_t count);
+static void readseg(uint32_t va, uint32_t filesz, uint32_t memsz, uint32_t offset);
 
 void
 bootmain(void)
@@ -67,7 +67,7 @@ bad:
 
 // Read 'filesz' bytes at 'offset' from kernel into virtual address 'va',
 // then clear the memory from 'va+filesz' up to 'va+memsz' (set it to 0).
-void
+static void
 readseg(uint32_t va, uint32_t filesz, uint32_t memsz, uint32_t offset)
 {
 	uint32_t end_va;
@@ -82,43 +82,59 @@ readseg(uint32_t va, uint32_t filesz, uint32_t memsz, uint32_t offset)
 	// translate from bytes to sectors, and kernel starts at sector 1
 	offset = (offset / SECTSIZE) + 1;
 
-	// read sectors
-	while (va < end_va) {
-		readsect((uint8_t*) va, offset);
-		va += SECTSIZE;
-		offset++;
-	}
+	// read sectors, all in one command: a segment of the boot image
+	// is far below the 32MB one command can read
+	if (va < end_va)
+		readsects((uint8_t*) va, offset,
+			  (end_va - va + SECTSIZE - 1) / SECTSIZE);
 
 	// clear bss segment
 	while (end_va < memsz)
 		*((uint8_t*) end_va++) = 0;
 }
 
-void
-waitdisk(void)
+// Wait until the disk is no longer busy and its status, masked to
+// DRDY and DRQ, is 'status': 0x40 when ready for a command, 0x48 when
+// it has a sector for us.
+static void
+waitdisk(uint8_t status)
 {
-	// wait for disk reaady
-	while ((inb(0x1F7) & 0xC0) != 0x40)
+	while ((inb(0x1F7) & 0xC8) != status)
 		/* do nothing */;
 }
 
-void
-readsect(void *dst, uint32_t offset)
+// Read 'count' sectors (1 to 65536) starting at sector 'lba' with a
+// single command: an LBA28 READ SECTORS for up to 256 sectors, else an
+// LBA48 READ SECTORS EXT.  The LBA48 registers take the high-order byte
+// first; LBA28 commands only look at the last byte written, so the
+// registers are loaded the same way for both.
+static void
+readsects(uint8_t *dst, uint32_t lba, uint32_t count)
 {
-	// wait for disk to be ready
-	waitdisk();
-
-	outb(0x1F2, 1);		// count = 1
-	outb(0x1F3, offset);
-	outb(0x1F4, offset >> 8);
-	outb(0x1F5, offset >> 16);
-	outb(0x1F6, (offset >> 24) | 0xE0);
-	outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
+	int i;
 
 	// wait for disk to be ready
-	waitdisk();
-
-	// read a sector
-	insl(0x1F0, dst, SECTSIZE/4);
+	waitdisk(0x40);
+
+	outb(0x1F2, count >> 8);
+	outb(0x1F3, lba >> 24);
+	outb(0x1F4, 0);
+	outb(0x1F5, 0);
+	outb(0x1F2, count);
+	outb(0x1F3, lba);
+	outb(0x1F4, lba >> 8);
+	outb(0x1F5, lba >> 16);
+	outb(0x1F6, (lba >> 24) | 0xE0);
+	outb(0x1F7, count > 256 ? 0x24 : 0x20);	// read sectors (ext)
+
+	// the disk raises DRQ for each sector in turn; after a sector,
+	// its status is only valid again 400ns later, which four reads of
+	// the alternate status register take
+	while (count-- > 0) {
+		waitdisk(0x48);
+		insl(0x1F0, dst, SECTSIZE/4);
+		for (i = 0; i < 4; i++)
+			inb(0x3F6);
+		dst += SECTSIZE;
+	}
 }
-
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#if defined(_MSDOS) || defined(_WIN32)
+# include <fcntl.h>
+# include <io.h>
+#endif
+
+#include <inc/elf.h>
+#include <inc/zkernel.h>
+
+/* This program makes a compressed kernel.
+ * It reads the kernel ELF file, compresses each of its load segments
+ * into an LZ4 block, and writes the result, in the format described in
+ * inc/zkernel.h, to standard output.  boot/zboot.c is linked with the
+ * result and unpacks it at boot time.
+ *
+ * The compressor is the simple greedy one: hash the next 4 bytes, look
+ * up the last position with the same hash, and take the match if there
+ * is one.  That is far from the best LZ4 can do, but decompression speed
+ * does not depend on how hard the compressor tried.
+ *
+ * With "-l LIMIT", segments must end at or below physical address LIMIT,
+ * where the decompressor itself is loaded.
+ *
+ * It runs on the build host, like mkbootdisk.
+ */
+
+#define HASH_BITS	16
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: mkzkernel [-l LIMIT] KERNEL\n");
+	exit(1);
+}
+
+static uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static size_t
+putlen(uint8_t *out, size_t op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		out[op++] = 255;
+	out[op++] = len;
+	return op;
+}
+
+// Emit one sequence: 'nlit' literals from 'lit', then, if 'mlen' is not
+// zero, a match of 'mlen' bytes 'off' bytes back.
+static size_t
+emit(uint8_t *out, size_t op, const uint8_t *lit, size_t nlit,
+     size_t off, size_t mlen)
+{
+	size_t tp = op++;
+	uint8_t token;
+
+	token = (nlit >= 15 ? 15 : nlit) << 4;
+	if (nlit >= 15)
+		op = putlen(out, op, nlit - 15);
+	memcpy(out + op, lit, nlit);
+	op += nlit;
+
+	if (mlen) {
+		out[op++] = off & 0xFF;
+		out[op++] = off >> 8;
+		mlen -= ZK_MINMATCH;
+		token |= mlen >= 15 ? 15 : mlen;
+		if (mlen >= 15)
+			op = putlen(out, op, mlen - 15);
+	}
+	out[tp] = token;
+	return op;
+}
+
+// Compress 'n' bytes at 'in' into 'out', which must have room for
+// n + n / 255 + 16 bytes.  Returns the compressed size.
+static size_t
+lz4_encode(const uint8_t *in, size_t n, uint8_t *out)
+{
+	static long table[1 << HASH_BITS];
+	size_t ip = 0, anchor = 0, op = 0, ref, mlen;
+	uint32_t seq, h;
+
+	memset(table, 0xFF, sizeof(table));
+	while (ip + ZK_MFLIMIT < n) {
+		seq = read32(in + ip);
+		h = (seq * 2654435761U) >> (32 - HASH_BITS);
+		ref = table[h];
+		table[h] = ip;
+		if (ref == (size_t) -1 || ip - ref > ZK_MAXOFFSET || read32(in + ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		// extend the match backwards over pending literals, then forwards
+		while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1])
+			ip--, ref--;
+		mlen = ZK_MINMATCH;
+		while (ip + mlen < n - ZK_LASTLITERALS
+		       && in[ip + mlen] == in[ref + mlen])
+			mlen++;
+
+		op = emit(out, op, in + anchor, ip - anchor, ip - ref, mlen);
+		ip += mlen;
+		anchor = ip;
+	}
+
+	// the rest is literals
+	return emit(out, op, in + anchor, n - anchor, 0, 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct zkernel zk;
+	struct zkseg zs;
+	struct Elf *elf;
+	struct Proghdr *ph;
+	uint8_t *buf, *out;
+	unsigned long limit = 0;
+	size_t size, total = 0, ctotal = 0;
+	long len;
+	char *str;
+	FILE *f;
+	int i;
+
+#if defined(_MSDOS) || defined(_WIN32)
+	// As our output file is binary, we must set its file mode to binary.
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	if (argc == 4 && strcmp(argv[1], "-l") == 0) {
+		limit = strtoul(argv[2], &str, 0);
+		if (*str != 0)
+			usage();
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc != 2)
+		usage();
+
+	// Read the whole kernel
+	if (!(f = fopen(argv[1], "rb"))) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		usage();
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	if (len < (long) sizeof(*elf) || !(buf = malloc(len))
+	    || fread(buf, 1, len, f) != (size_t) len) {
+		fprintf(stderr, "%s: can't read kernel\n", argv[1]);
+		exit(1);
+	}
+	fclose(f);
+
+	elf = (struct Elf *) buf;
+	if (elf->e_magic != ELF_MAGIC
+	    || elf->e_phoff + elf->e_phnum * sizeof(*ph) > (size_t) len) {
+		fprintf(stderr, "%s: not an ELF file\n", argv[1]);
+		exit(1);
+	}
+	ph = (struct Proghdr *) (buf + elf->e_phoff);
+
+	zk.zk_magic = ZKERNEL_MAGIC;
+	zk.zk_entry = elf->e_entry;
+	zk.zk_nseg = 0;
+	zk.zk_size = 0;
+	for (i = 0; i < elf->e_phnum; i++)
+		if (ph[i].p_type == ELF_PROG_LOAD && ph[i].p_memsz) {
+			zk.zk_nseg++;
+			zk.zk_size += ph[i].p_filesz;
+		}
+	fwrite(&zk, sizeof(zk), 1, stdout);
+
+	for (i = 0; i < elf->e_phnum; i++) {
+		if (ph[i].p_type != ELF_PROG_LOAD || !ph[i].p_memsz)
+			continue;
+		if (ph[i].p_offset + ph[i].p_filesz > (size_t) len
+		    || ph[i].p_filesz > ph[i].p_memsz) {
+			fprintf(stderr, "%s: bad segment %d\n", argv[1], i);
+			exit(1);
+		}
+		zs.zs_va = ph[i].p_va & 0xFFFFFF;
+		if (limit && zs.zs_va + ph[i].p_memsz > limit) {
+			fprintf(stderr, "%s: segment %d ends at 0x%lx, past 0x%lx\n", argv[1], i, (unsigned long) zs.zs_va + ph[i].p_memsz, limit);
+			exit(1);
+		}
+
+		size = ph[i].p_filesz;
+		if (!(out = malloc(size + size / 255 + 16))) {
+			fprintf(stderr, "mkzkernel: out of memory\n");
+			exit(1);
+		}
+		zs.zs_filesz = size;
+		zs.zs_memsz = ph[i].p_memsz;
+		zs.zs_csize = lz4_encode(buf + ph[i].p_offset, size, out);
+		fwrite(&zs, sizeof(zs), 1, stdout);
+		fwrite(out, 1, zs.zs_csize, stdout);
+		fwrite("\0\0\0", 1, (4 - zs.zs_csize % 4) % 4, stdout);
+		free(out);
+
+		total += size;
+		ctotal += zs.zs_csize;
+	}
+
+	fprintf(stderr, "mkzkernel: %lu bytes in %u segments -> %lu bytes (%lu%%)\n", (unsigned long) total, (unsigned) zk.zk_nseg, (unsigned long) ctotal, total ? (unsigned long) (ctotal * 100 / total) : 0UL);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include <inc/x86.h>
+#include <inc/zkernel.h>
+
+/**********************************************************************
+ * Decompressor stage for a compressed kernel image.
+ *
+ * With ZKERNEL=1, the disk holds this program instead of the kernel,
+ * with the output of boot/mkzkernel.c linked into it as data.  The boot
+ * loader in boot/main.c loads it like any other ELF file and jumps to
+ * zbootmain(), which decompresses each kernel segment straight to the
+ * address the boot loader would have read it to, clears the rest of the
+ * segment, and jumps to the kernel's entry point.  The kernel finds the
+ * machine exactly as boot/main.c would have left it.
+ *
+ * The kernel segments are mostly code, strings and stabs, which LZ4
+ * shrinks to less than half, so the boot loader reads less than half
+ * as many sectors; LZ4 decoding is only copies, so it costs far less
+ * than the disk time it saves.
+ *
+ * This stage is linked high (see ZBOOT_ADDR in kern/Makefrag), out of
+ * the way of the kernel; mkzkernel refuses kernels that would reach it.
+ **********************************************************************/
+
+extern uint8_t _binary_obj_kernel_z_start[];
+
+static uint8_t *lz4_decode(uint8_t *dst, const uint8_t *src, const uint8_t *end);
+
+void
+zbootmain(void)
+{
+	struct zkernel *zk = (struct zkernel *) _binary_obj_kernel_z_start;
+	struct zkseg *zs;
+	uint8_t *p, *dst, *end;
+	uint32_t i;
+
+	if (zk->zk_magic != ZKERNEL_MAGIC)
+		goto bad;
+
+	zs = (struct zkseg *) (zk + 1);
+	for (i = 0; i < zk->zk_nseg; i++) {
+		p = (uint8_t *) (zs + 1);
+		dst = (uint8_t *) (zs->zs_va & 0xFFFFFF);
+		if (lz4_decode(dst, p, p + zs->zs_csize) != dst + zs->zs_filesz)
+			goto bad;
+
+		// clear the bss part of the segment
+		end = dst + zs->zs_memsz;
+		for (dst += zs->zs_filesz; dst < end; dst++)
+			*dst = 0;
+
+		zs = (struct zkseg *) (p + ((zs->zs_csize + 3) & ~3));
+	}
+
+	// note: does not return!
+	((void (*)(void)) (zk->zk_entry & 0xFFFFFF))();
+
+bad:
+	outw(0x8A00, 0x8A00);
+	outw(0x8A00, 0x8E00);
+	while (1)
+		/* do nothing */;
+}
+
+// Decode one LZ4 block from [src, end) to dst; returns the end of the
+// output.  Matches may overlap their own output (offset < length is how
+// LZ4 encodes runs), so they are copied a byte at a time, forwards.
+static uint8_t *
+lz4_decode(uint8_t *dst, const uint8_t *src, const uint8_t *end)
+{
+	uint32_t token, len;
+	const uint8_t *match;
+
+	while (src < end) {
+		token = *src++;
+
+		// literals
+		len = token >> 4;
+		if (len == 15)
+			do
+				len += *src;
+			while (*src++ == 255);
+		__asm __volatile("cld; rep movsb"
+				 : "+D" (dst), "+S" (src), "+c" (len)
+				 : : "memory", "cc");
+
+		// the last sequence has no match
+		if (src >= end)
+			break;
+
+		match = dst - (src[0] | (src[1] << 8));
+		src += 2;
+		len = token & 15;
+		if (len == 15)
+			do
+				len += *src;
+			while (*src++ == 255);
+		len += ZK_MINMATCH;
+		while (len-- > 0)
+			*dst++ = *match++;
+	}
+	return dst;
+}
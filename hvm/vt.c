@@ -29,10 +29,18 @@
  */
 
 #include <inc/hvm/vt.h>
+#include <inc/hvm/vt_emulate.h>
+#include <inc/hvm/vt_hypercall.h>
+#include <inc/hvm/vt_pic.h>
+#include <inc/hvm/vt_prof.h>
+#include <inc/hvm/vt_trace.h>
+#include <inc/hvm/vt_vga.h>
+#include <inc/hvm/vt_vm.h>
+#include <inc/error.h>
 #include <inc/x86.h>
 #include <kern/console.h>
-
-struct vt_vmentry_regs vr;
+#include <kern/klog.h>
+#include <kern/picirq.h>
 
 enum vt_status {
 	VT_VMENTRY_SUCCESS,
@@ -40,22 +48,55 @@ enum vt_status {
 	VT_VMEXIT,
 };
 
-static void
+/*
+ * A guest access the EPT didn't allow.  Returns false if no device or
+ * memory model claims it, which stops the VM: it touched memory it
+ * doesn't have, such as RAM past its memsize.
+ */
+static bool
 do_ept_violation (void)
 {
 	ulong error_code;
 	ulong guest_linear_addr;
 	ulong guest_physical_addr;
 	ulong guest_physical_addr_high;
+	phys_t gpa;
+	bool handled;
+	int r;
+
+	HVPROF_PROBE ();
 	asm_vmread(VMCS_EXIT_QUALIFICATION, &error_code);
 	asm_vmread(VMCS_GUEST_LINEAR_ADDR, &guest_linear_addr);
 	asm_vmread(VMCS_GUEST_PHYSICAL_ADDR, &guest_physical_addr);
 	asm_vmread(VMCS_GUEST_PHYSICAL_ADDR_HIGH, &guest_physical_addr_high);
-	cprintf("EPT_Violation Error code: %#08lx\n", error_code);
-	cprintf("EPT_Violation guest_linear_addr: %#08lx\n", guest_linear_addr);
-	cprintf("EPT_Violation guest_physical_addr: %#08lx\n", guest_physical_addr);
-	cprintf("EPT_Violation guest_physical_addr_high: %#08lx\n", guest_physical_addr_high);
-	panic("EPT_Violation");
+
+	gpa = guest_physical_addr | (phys_t)guest_physical_addr_high << 32;
+	if ((r = vm_balloon_fault(gpa)) < 0) {
+		cprintf("VM %d: balloon fault: %e\n", curvm->id, r);
+		return false;
+	}
+	if (r > 0)
+		return true;
+	if (error_code & EPT_VIOLATION_WRITE_BIT) {
+		/* A page can be both copy-on-write and dirty-tracked. */
+		if ((r = vm_cow_fault(gpa)) < 0) {
+			cprintf("VM %d: copy-on-write fault: %e\n", curvm->id, r);
+			return false;
+		}
+		handled = r > 0;
+		handled |= vt_vga_write_fault(gpa);
+		handled |= vt_emulate_code_write(gpa);
+		if (handled)
+			return true;
+	}
+	if (vt_emulate_mmio(gpa))
+		return true;
+
+	cprintf("VM %d: EPT_Violation Error code: %#08lx\n", curvm->id, error_code);
+	cprintf("VM %d: EPT_Violation guest_linear_addr: %#08lx\n", curvm->id, guest_linear_addr);
+	cprintf("VM %d: EPT_Violation guest_physical_addr: %#08lx\n", curvm->id, guest_physical_addr);
+	cprintf("VM %d: EPT_Violation guest_physical_addr_high: %#08lx\n", curvm->id, guest_physical_addr_high);
+	return false;
 }
 
 static void
@@ -90,6 +131,8 @@ do_cpuid (void)
 	u32 ia, oa, ob, oc, od;
 	ulong la;
 
+	HVPROF_PROBE ();
+
 	vt_read_general_reg(GENERAL_REG_RAX, &la);
 
 	/* Ex5: The CODE */
@@ -105,9 +148,11 @@ do_cpuid (void)
 	ia = la;
 	cpuid(ia, &oa, &ob, &oc, &od);
 
-	/* remove vmx support in Matrix */
-	if (ia == CPUID_1)
+	/* remove vmx support in Matrix, and say there is a hypervisor */
+	if (ia == CPUID_1) {
 		oc &= ~CPUID_1_ECX_VMX_BIT;
+		oc |= CPUID_1_ECX_HYPERVISOR_BIT;
+	}
 
 	vt_write_general_reg(GENERAL_REG_RAX, oa);
 	vt_write_general_reg(GENERAL_REG_RBX, ob);
@@ -117,6 +162,122 @@ do_cpuid (void)
 	add_ip();
 }
 
+/*
+ * MOV to CR3: load the guest's CR3 and flush its translations.  Any
+ * other control register access is unexpected; only this VM is stopped.
+ */
+/*
+ * PAE paging takes its four PDPTEs from memory when CR3 is loaded, and
+ * with EPT a VM entry takes them from the VMCS, so a MOV to CR3 that
+ * exited has to load them there.
+ */
+static bool
+load_pdptes (ulong cr3)
+{
+	u64 pdpte[4];
+	int i;
+
+	if (vt_gpa_read (cr3 & CR3_PAE_PDPT_MASK, pdpte, sizeof (pdpte)) < 0)
+		return false;
+	for (i = 0; i < 4; i++) {
+		asm_vmwrite (VMCS_GUEST_PDPTE0 + i * 2, (ulong)pdpte[i]);
+		asm_vmwrite (VMCS_GUEST_PDPTE0_HIGH + i * 2, pdpte[i] >> 32);
+	}
+	return true;
+}
+
+static bool
+do_mov_cr (void)
+{
+	ulong qual, val, cr0, cr4;
+
+	HVPROF_PROBE ();
+
+	asm_vmread (VMCS_EXIT_QUALIFICATION, &qual);
+	if ((qual & EXIT_QUAL_CR_NUM_MASK) != 3 ||
+	    (qual & EXIT_QUAL_CR_TYPE_MASK) != EXIT_QUAL_CR_TYPE_MOV_TO_CR) {
+		cprintf ("VM %d: unexpected control register access %#lx\n",
+			 curvm->id, qual);
+		return false;
+	}
+	vt_read_general_reg ((qual & EXIT_QUAL_CR_GPR_MASK) >> EXIT_QUAL_CR_GPR_SHIFT,
+			     &val);
+	asm_vmwrite (VMCS_GUEST_CR3, val);
+	asm_vmread (VMCS_GUEST_CR0, &cr0);
+	asm_vmread (VMCS_GUEST_CR4, &cr4);
+	if ((cr0 & CR0_PG_BIT) && (cr4 & CR4_PAE_BIT) && !load_pdptes (val)) {
+		cprintf ("VM %d: PDPT at %#lx is not in guest memory\n",
+			 curvm->id, val);
+		return false;
+	}
+	vt_emulate_tlb_flush ();
+	add_ip ();
+	return true;
+}
+
+static void
+do_invlpg (void)
+{
+	ulong gla;
+
+	HVPROF_PROBE ();
+
+	asm_vmread (VMCS_EXIT_QUALIFICATION, &gla);
+	vt_emulate_invlpg (gla);
+	add_ip ();
+}
+
+static void
+do_vmcall (void)
+{
+	ulong nr, a1, a2;
+	long r;
+
+	HVPROF_PROBE ();
+
+	vt_read_general_reg (GENERAL_REG_RAX, &nr);
+	vt_read_general_reg (GENERAL_REG_RBX, &a1);
+	vt_read_general_reg (GENERAL_REG_RCX, &a2);
+	switch (nr) {
+	case HC_BALLOON_INFLATE:
+	case HC_BALLOON_DEFLATE:
+		r = vm_balloon (nr == HC_BALLOON_INFLATE, a1, a2);
+		break;
+	case HC_HOST_MONITOR:
+		vm_escape = true;
+		curvm->preempted = true;
+		r = 0;
+		break;
+	default:
+		r = -E_INVAL;
+	}
+	vt_write_general_reg (GENERAL_REG_RAX, r);
+	add_ip ();
+}
+
+/*
+ * HLT: give up the rest of the time slice.  vm_sched() runs the VM again
+ * once nothing else is runnable, as if the interrupt it waits for had
+ * come.  With interrupts disabled nothing would ever wake it, so the VM
+ * stops instead.
+ */
+static bool
+do_hlt (void)
+{
+	ulong rflags;
+
+	HVPROF_PROBE ();
+
+	asm_vmread (VMCS_GUEST_RFLAGS, &rflags);
+	if (!(rflags & RFLAGS_IF_BIT)) {
+		cprintf ("VM %d: HLT with interrupts disabled\n", curvm->id);
+		return false;
+	}
+	add_ip();
+	curvm->state = VM_HALTED;
+	return true;
+}
+
 static bool
 vt_exit_reason (void)
 {
@@ -139,11 +300,34 @@ vt_exit_reason (void)
 			do_cpuid();
 			break;
 		case EXIT_REASON_EPT_VIOLATION:
-			do_ept_violation();
+			if (!do_ept_violation())
+				return false;
 			break;
 		case EXIT_REASON_EPT_MISCONFIG:
 			do_ept_misconfig();
 			break;
+		case EXIT_REASON_HLT:
+			if (!do_hlt())
+				return false;
+			break;
+		case EXIT_REASON_VMCALL:
+			do_vmcall();
+			break;
+		case EXIT_REASON_MOV_CR:
+			if (!do_mov_cr())
+				return false;
+			break;
+		case EXIT_REASON_IO_INSTRUCTION:
+			if (!vt_pic_io())
+				return false;
+			add_ip();
+			break;
+		case EXIT_REASON_INVLPG:
+			do_invlpg();
+			break;
+		case EXIT_REASON_VMX_PREEMPT_TIMER:
+			curvm->preempted = true;
+			break;
 		case EXIT_REASON_INIT_SIGNAL:
 			return false;
 		default:
@@ -157,7 +341,7 @@ vt_exit_reason (void)
 enum vt_status
 vt_vmlaunch (void)
 {
-	if (asm_vmlaunch_regs(&vr))
+	if (asm_vmlaunch_regs(&curvm->regs))
 		return VT_VMENTRY_FAILED;
 	return VT_VMEXIT;
 }
@@ -165,7 +349,7 @@ vt_vmlaunch (void)
 static enum vt_status
 vt_vmresume (void)
 {
-	if (asm_vmresume_regs (&vr))
+	if (asm_vmresume_regs (&curvm->regs))
 		return VT_VMENTRY_FAILED;
 	return VT_VMEXIT;
 }
@@ -202,19 +386,56 @@ vt_run (void)
 	}
 }
 
+/*
+ * Run curvm until its time slice is used up, or it halts or stops.
+ */
+void
+vt_run_slice (void)
+{
+	struct vt_trace_rec *rec;
+	bool handled;
+
+	curvm->preempted = false;
+	pic_guest(curvm->pic.regs);
+	asm_vmwrite(VMCS_VMX_PREEMPTION_TIMER_VALUE,
+		    VM_TIMESLICE >> vt_preempt_rate);
+
+	while (curvm->state == VM_RUNNABLE && !curvm->preempted) {
+		if (!curvm->launched) {
+			vt_first_run();
+			curvm->launched = true;
+			klog("VM %d launch Success\n", curvm->id);
+		} else
+			vt_run();
+		curvm->nexits++;
+
+		if (hvprof_on)
+			hvprof_exit_begin ();
+		rec = vt_trace_on ? vt_trace_begin () : NULL;
+		handled = vt_exit_reason ();
+		if (rec)
+			vt_trace_end (rec);
+		if (!handled) {
+			curvm->state = VM_STOPPED;
+			vt_vga_sync(true);
+			get_cursor_loc();
+			cprintf("VM %d Stopped\n", curvm->id);
+		} else
+			vt_vga_sync(false);
+		hvprof_exit_end ();
+	}
+}
+
 void
 vt_main(void)
 {
-	vt_init();
-	cprintf("Start VM...\n");
-
-	vt_first_run();
-	cprintf("VM launch Success\n");
+	struct vm *vm;
+	int r;
 
-	while(vt_exit_reason())
-	{
-		vt_run ();
+	if ((r = vm_create(&vm)) < 0) {
+		cprintf("Can't create VM: %e\n", r);
+		return;
 	}
-	get_cursor_loc();
-	cprintf("VM Stopped\n");
+	cprintf("Start VM %d...\n", vm->id);
+	vm_sched();
 }
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inc/hvm/vt.h>
+#include <inc/hvm/vt_dbgcon.h>
+#include <inc/hvm/vt_emulate.h>
+#include <inc/hvm/vt_vm.h>
+#include <kern/klog.h>
+
+static void
+dbgcon_flush (struct vm *vm)
+{
+	struct vt_dbgcon *con = &vm->dbgcon;
+
+	con->line[con->len] = '\0';
+	klog ("vm %d: %s\n", vm->id, con->line);
+	con->len = 0;
+}
+
+static void
+dbgcon_access (phys_t gpa, bool write, void *data, uint len, void *arg)
+{
+	struct vm *vm = arg;
+	struct vt_dbgcon *con = &vm->dbgcon;
+	u8 *p = data;
+	u32 magic = DBGCON_MAGIC;
+	uint i, off;
+
+	if (!write) {
+		off = gpa - DBGCON_BASE;
+		memset (data, 0, len);
+		if (off < sizeof (magic))
+			memcpy (data, (u8 *)&magic + off,
+				MIN (len, sizeof (magic) - off));
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		con->nbytes++;
+		if (p[i] == '\n') {
+			dbgcon_flush (vm);
+			continue;
+		}
+		con->line[con->len++] = p[i];
+		if (con->len == DBGCON_LINE - 1)
+			dbgcon_flush (vm);
+	}
+}
+
+/* Give curvm its debug console. */
+int
+vt_dbgcon_init (void)
+{
+	memset (&curvm->dbgcon, 0, sizeof (curvm->dbgcon));
+	return vt_mmio_register (DBGCON_BASE, DBGCON_SIZE, dbgcon_access,
+				 curvm);
+}
@@ -0,0 +1,1175 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inc/hvm/vt.h>
+#include <inc/hvm/vt_dbgcon.h>
+#include <inc/hvm/vt_ept.h>
+#include <inc/hvm/vt_emulate.h>
+#include <inc/hvm/vt_prof.h>
+#include <inc/hvm/vt_vm.h>
+#include <inc/error.h>
+#include <kern/klog.h>
+
+/* Segment register numbers, in instruction encoding order. */
+enum {
+	SREG_ES = 0,
+	SREG_CS = 1,
+	SREG_SS = 2,
+	SREG_DS = 3,
+	SREG_FS = 4,
+	SREG_GS = 5,
+};
+
+enum {
+	ACCESS_READ,
+	ACCESS_WRITE,
+	ACCESS_FETCH,
+};
+
+#define SIZE_MASK(size)	((size) == 4 ? 0xFFFFFFFFUL : (1UL << ((size) * 8)) - 1)
+#define ARITH_FLAGS	(RFLAGS_CF_BIT | RFLAGS_PF_BIT | RFLAGS_AF_BIT | \
+			 RFLAGS_ZF_BIT | RFLAGS_SF_BIT | RFLAGS_OF_BIT)
+
+/*
+ * Decoded instructions, direct-mapped by the guest physical address of
+ * the instruction.  The code page an entry was decoded from is
+ * write-protected in the EPT and given a generation number; as long as
+ * the page keeps that generation the entry is used without fetching the
+ * guest bytes again.  Entries whose page could not be protected fall
+ * back to comparing the bytes.  So do entries from a page that took
+ * CODE_PAGE_MAXWRITES writes: it holds data as well as code, as real
+ * mode guests' pages often do, and protecting it again would only trade
+ * each fetch for an exit on the next write.
+ */
+#define INSN_CACHE_SIZE	64
+#define CODE_PAGES	16
+#define CODE_PAGE_MAXWRITES	4
+
+struct insn_cache_entry {
+	bool valid;
+	u8 mode;
+	phys_t gpa;
+	u32 gen;
+	u8 bytes[VT_INSN_MAXLEN];
+	struct vt_insn insn;
+};
+
+struct code_page {
+	bool valid;
+	bool protected;		/* read-only in the EPT, 'gen' is current */
+	u8 nwrites;		/* writes that unprotected it */
+	phys_t gpa;
+	u32 gen;
+};
+
+static struct code_page code_pages[CODE_PAGES];
+static u32 code_gen;
+
+static struct insn_cache_entry insn_cache[INSN_CACHE_SIZE];
+
+struct vt_emulate_stats vt_emulate_stats;
+
+/*
+ * Translation cache, so that repeated accesses to the same guest buffers
+ * don't pay for a walk of the guest page tables plus a walk of the EPT
+ * every time.  Stage 1 caches the guest's page tables (linear page to
+ * guest physical page), tagged with CR3 and the paging mode.  Like a
+ * TLB it is flushed when the guest loads CR3 or executes INVLPG, both
+ * of which exit.  Stage 2 caches the EPT (guest physical page to host
+ * physical page) and is flushed whenever the EPT changes.  Only
+ * successful translations are cached.
+ *
+ * CR3 loads and INVLPG only exit while stage 1 holds translations:
+ * filling it arms both exits, and flushing it disarms them, so guests
+ * that never have instructions emulated with paging on run without.
+ */
+#define GTLB_SIZE	64
+#define P2M_CACHE_SIZE	64
+
+struct gtlb_entry {
+	bool valid;
+	ulong cr3;
+	ulong mode;		/* CR0.PG, CR4.PAE and CR4.PSE when filled */
+	ulong gla;		/* page aligned */
+	ulong offmask;		/* offset mask of the guest's mapping */
+	phys_t gpa;		/* page aligned */
+};
+
+struct p2m_cache_entry {
+	bool valid;
+	phys_t gpa;		/* page aligned */
+	phys_t hpa;		/* page aligned */
+};
+
+static struct gtlb_entry gtlb[GTLB_SIZE];
+static bool gtlb_armed;		/* CR3 load and INVLPG exit */
+static struct p2m_cache_entry p2m_cache[P2M_CACHE_SIZE];
+
+static ulong
+vmcs_read (ulong field)
+{
+	ulong val;
+
+	asm_vmread (field, &val);
+	return val;
+}
+
+/* Make CR3 loads and INVLPG exit, or not, for the current VMCS. */
+static void
+gtlb_arm (bool arm)
+{
+	ulong ctl;
+
+	ctl = vmcs_read (VMCS_PROC_BASED_VMEXEC_CTL);
+	if (arm)
+		ctl |= VMCS_PROC_BASED_VMEXEC_CTL_CR3LOADEXIT_BIT |
+			VMCS_PROC_BASED_VMEXEC_CTL_INVLPGEXIT_BIT;
+	else
+		ctl &= ~(VMCS_PROC_BASED_VMEXEC_CTL_CR3LOADEXIT_BIT |
+			 VMCS_PROC_BASED_VMEXEC_CTL_INVLPGEXIT_BIT);
+	asm_vmwrite (VMCS_PROC_BASED_VMEXEC_CTL, ctl);
+	gtlb_armed = arm;
+}
+
+static ulong
+seg_base (uint seg)
+{
+	return vmcs_read (VMCS_GUEST_ES_BASE + 2 * seg);
+}
+
+/* Default operand and address size of the guest code segment, in bytes. */
+static uint
+cs_mode (void)
+{
+	if (vmcs_read (VMCS_GUEST_CS_ACCESS_RIGHTS) & ACCESS_RIGHTS_D_B_BIT)
+		return 4;
+	return 2;
+}
+
+static ulong
+reg_read (uint reg, uint size)
+{
+	ulong val;
+
+	if (size == 1 && reg >= 4) {
+		/* AH, CH, DH, BH */
+		vt_read_general_reg (reg - 4, &val);
+		return (val >> 8) & 0xFF;
+	}
+	vt_read_general_reg (reg, &val);
+	return val & SIZE_MASK (size);
+}
+
+static void
+reg_write (uint reg, uint size, ulong val)
+{
+	ulong old, mask;
+
+	if (size == 4) {
+		vt_write_general_reg (reg, val);
+		return;
+	}
+	if (size == 1 && reg >= 4) {
+		vt_read_general_reg (reg - 4, &old);
+		old = (old & ~0xFF00UL) | ((val & 0xFF) << 8);
+		vt_write_general_reg (reg - 4, old);
+		return;
+	}
+	mask = SIZE_MASK (size);
+	vt_read_general_reg (reg, &old);
+	vt_write_general_reg (reg, (old & ~mask) | (val & mask));
+}
+
+static struct code_page *
+code_page_find (phys_t gpa)
+{
+	struct code_page *cp;
+
+	cp = &code_pages[(gpa >> PAGESIZE_SHIFT) % CODE_PAGES];
+	if (cp->valid && cp->gpa == (gpa & ~(phys_t)PAGESIZE_MASK))
+		return cp;
+	return NULL;
+}
+
+static void
+ept_set_writable (phys_t gpa, bool writable)
+{
+	ept_entry_t *entry;
+	int level;
+
+	entry = ept_walk (gpa, &level);
+	if (entry == NULL || level != 0)
+		return;
+	entry->w = writable;
+	ept_invalidate ();
+}
+
+/*
+ * Write-protect the code page containing 'gpa' and return its
+ * generation, or 0 if the page can't or shouldn't be protected.
+ */
+static u32
+code_page_protect (phys_t gpa)
+{
+	struct code_page *cp;
+	ept_entry_t *entry;
+	int level;
+
+	cp = code_page_find (gpa);
+	if (cp != NULL && cp->protected)
+		return cp->gen;
+	if (cp != NULL && cp->nwrites >= CODE_PAGE_MAXWRITES)
+		return 0;
+
+	entry = ept_walk (gpa, &level);
+	if (entry == NULL || level != 0 || !entry->w)
+		return 0;
+
+	if (cp == NULL) {
+		cp = &code_pages[(gpa >> PAGESIZE_SHIFT) % CODE_PAGES];
+		if (cp->valid && cp->protected)
+			ept_set_writable (cp->gpa, true);
+		cp->valid = true;
+		cp->gpa = gpa & ~(phys_t)PAGESIZE_MASK;
+		cp->nwrites = 0;
+	}
+	entry->w = 0;
+	ept_invalidate ();
+	cp->protected = true;
+	cp->gen = ++code_gen;
+	return cp->gen;
+}
+
+/*
+ * The code page containing 'gpa' is about to be written: make it
+ * writable, which invalidates every cached instruction decoded from it.
+ * Returns false if the page was not protected.
+ */
+static bool
+code_page_unprotect (phys_t gpa)
+{
+	struct code_page *cp;
+
+	if ((cp = code_page_find (gpa)) == NULL || !cp->protected)
+		return false;
+	cp->protected = false;
+	ept_set_writable (gpa, true);
+	vt_emulate_stats.ncode_writes++;
+	if (++cp->nwrites == CODE_PAGE_MAXWRITES)
+		vt_emulate_stats.nmixed_pages++;
+	return true;
+}
+
+static struct vt_mmio_region *
+mmio_find (phys_t gpa)
+{
+	int i;
+
+	for (i = 0; i < curvm->nmmio; i++)
+		if (gpa >= curvm->mmio[i].base &&
+		    gpa - curvm->mmio[i].base < curvm->mmio[i].len)
+			return &curvm->mmio[i];
+	return NULL;
+}
+
+/* ept_gpa2hpa() through the stage 2 translation cache */
+static int
+gpa2hpa (phys_t gpa, phys_t *hpa)
+{
+	struct p2m_cache_entry *e;
+	phys_t page = gpa & ~(phys_t)PAGESIZE_MASK;
+	int r;
+
+	e = &p2m_cache[(page >> PAGESIZE_SHIFT) % P2M_CACHE_SIZE];
+	if (!e->valid || e->gpa != page) {
+		if ((r = ept_gpa2hpa (page, &e->hpa)) < 0) {
+			e->valid = false;
+			return r;
+		}
+		e->gpa = page;
+		e->valid = true;
+	}
+	*hpa = e->hpa | (gpa & PAGESIZE_MASK);
+	return 0;
+}
+
+/* Access guest physical memory.  [gpa, gpa+len) must not cross a page. */
+static int
+gpa_access (phys_t gpa, void *data, uint len, int access)
+{
+	struct vt_mmio_region *r;
+	phys_t hpa;
+	void *p;
+
+	if ((r = mmio_find (gpa)) != NULL) {
+		if (access == ACCESS_FETCH)
+			return -E_FAULT;
+		r->handler (gpa, access == ACCESS_WRITE, data, len, r->arg);
+		return 0;
+	}
+
+	/* These writes bypass the EPT write protection. */
+	if (access == ACCESS_WRITE) {
+		code_page_unprotect (gpa);
+		if (vm_cow_fault (gpa) < 0)
+			return -E_NO_MEM;
+	}
+
+	/* Guest RAM may be in high memory, so map it for the copy. */
+	if (gpa2hpa (gpa, &hpa) < 0 ||
+	    hpa + len > (phys_t)npages * PGSIZE)
+		return -E_FAULT;
+	p = kmap (pa2page (hpa));
+	if (access == ACCESS_WRITE)
+		memcpy ((char *)p + PGOFF (hpa), data, len);
+	else
+		memcpy (data, (char *)p + PGOFF (hpa), len);
+	kunmap (p);
+	return 0;
+}
+
+/* Read guest physical memory for the host, e.g. hypercall arguments. */
+int
+vt_gpa_read (phys_t gpa, void *data, uint len)
+{
+	uint n;
+
+	while (len > 0) {
+		n = MIN (len, (uint)(PAGESIZE - (gpa & PAGESIZE_MASK)));
+		if (gpa_access (gpa, data, n, ACCESS_READ) < 0)
+			return -E_FAULT;
+		gpa += n;
+		data = (u8 *)data + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Translate a guest linear address with PAE paging.  The processor
+ * loaded the four PDPTEs with CR3 and keeps them in the VMCS; below
+ * them the tables have 512 64-bit entries and a PDE may map 2MB.
+ */
+#define GUEST_PAE_PDPTX(gla)	(((gla) >> 30) & 0x3)
+#define GUEST_PAE_PDX(gla)	(((gla) >> 21) & 0x1FF)
+#define GUEST_PAE_PTX(gla)	(((gla) >> PAGESIZE_SHIFT) & 0x1FF)
+
+static int
+gla2gpa_walk_pae (ulong gla, phys_t *gpa, ulong *offmask)
+{
+	u64 pdpte, pde, pte;
+	uint i;
+
+	i = GUEST_PAE_PDPTX (gla);
+	pdpte = vmcs_read (VMCS_GUEST_PDPTE0 + i * 2) |
+		(u64)vmcs_read (VMCS_GUEST_PDPTE0_HIGH + i * 2) << 32;
+	if (!(pdpte & PDE_P_BIT))
+		return -E_FAULT;
+
+	if (gpa_access ((pdpte & PDE_ADDR_MASK64) +
+			GUEST_PAE_PDX (gla) * sizeof (pde), &pde, sizeof (pde),
+			ACCESS_FETCH) < 0 || !(pde & PDE_P_BIT))
+		return -E_FAULT;
+	if (pde & PDE_PS_BIT) {
+		*gpa = (pde & PDE_ADDR_MASK64 & PDE_2M_ADDR_MASK) |
+			(gla & PDE_2M_OFFSET_MASK);
+		*offmask = PDE_2M_OFFSET_MASK;
+		return 0;
+	}
+
+	if (gpa_access ((pde & PDE_ADDR_MASK64) +
+			GUEST_PAE_PTX (gla) * sizeof (pte), &pte, sizeof (pte),
+			ACCESS_FETCH) < 0 || !(pte & PTE_P_BIT))
+		return -E_FAULT;
+	*gpa = (pte & PTE_ADDR_MASK64) | (gla & PAGESIZE_MASK);
+	*offmask = PAGESIZE_MASK;
+	return 0;
+}
+
+/*
+ * Translate a guest linear address by walking the guest's own page
+ * tables.  32-bit paging (with optional 4MB pages) and PAE paging are
+ * understood.  '*offmask' gets the offset mask of the mapping, which
+ * is larger than a page for 4MB and 2MB pages.
+ */
+#define GUEST_PDX(gla)	(((gla) >> 22) & 0x3FF)
+#define GUEST_PTX(gla)	(((gla) >> PAGESIZE_SHIFT) & 0x3FF)
+
+static int
+gla2gpa_walk (ulong gla, ulong cr3, ulong cr4, phys_t *gpa, ulong *offmask)
+{
+	u32 pde, pte;
+
+	HVPROF_PROBE ();
+	if (cr4 & CR4_PAE_BIT)
+		return gla2gpa_walk_pae (gla, gpa, offmask);
+
+	if (gpa_access ((cr3 & PDE_4K_ADDR_MASK) +
+			GUEST_PDX (gla) * sizeof (pde), &pde, sizeof (pde),
+			ACCESS_FETCH) < 0 || !(pde & PDE_P_BIT))
+		return -E_FAULT;
+	if ((pde & PDE_PS_BIT) && (cr4 & CR4_PSE_BIT)) {
+		*gpa = (pde & PDE_4M_ADDR_MASK) | (gla & PDE_4M_OFFSET_MASK);
+		*offmask = PDE_4M_OFFSET_MASK;
+		return 0;
+	}
+
+	if (gpa_access ((pde & PDE_4K_ADDR_MASK) + GUEST_PTX (gla) * sizeof (pte),
+			&pte, sizeof (pte), ACCESS_FETCH) < 0 ||
+	    !(pte & PTE_P_BIT))
+		return -E_FAULT;
+	*gpa = (pte & PTE_ADDR_MASK) | (gla & PAGESIZE_MASK);
+	*offmask = PAGESIZE_MASK;
+	return 0;
+}
+
+/* Translate a guest linear address, through the stage 1 cache. */
+static int
+gla2gpa (ulong gla, phys_t *gpa)
+{
+	struct gtlb_entry *e;
+	ulong cr3, cr4, mode, page;
+	int r;
+
+	mode = vmcs_read (VMCS_GUEST_CR0) & CR0_PG_BIT;
+	if (!mode) {
+		*gpa = gla;
+		return 0;
+	}
+	cr4 = vmcs_read (VMCS_GUEST_CR4);
+	mode |= cr4 & (CR4_PAE_BIT | CR4_PSE_BIT);
+	cr3 = vmcs_read (VMCS_GUEST_CR3);
+	page = gla & ~PAGESIZE_MASK;
+
+	e = &gtlb[(page >> PAGESIZE_SHIFT) % GTLB_SIZE];
+	if (!e->valid || e->gla != page || e->cr3 != cr3 || e->mode != mode) {
+		if ((r = gla2gpa_walk (page, cr3, cr4, &e->gpa,
+					&e->offmask)) < 0) {
+			e->valid = false;
+			return r;
+		}
+		e->gla = page;
+		e->cr3 = cr3;
+		e->mode = mode;
+		e->valid = true;
+		if (!gtlb_armed)
+			gtlb_arm (true);
+	}
+	*gpa = e->gpa | (gla & PAGESIZE_MASK);
+	return 0;
+}
+
+/* Access guest linear memory, splitting the access at page boundaries. */
+static int
+gla_access (ulong gla, void *data, uint len, int access)
+{
+	phys_t gpa;
+	uint n;
+
+	while (len > 0) {
+		n = MIN (len, (uint)(PAGESIZE - (gla & PAGESIZE_MASK)));
+		if (gla2gpa (gla, &gpa) < 0 ||
+		    gpa_access (gpa, data, n, access) < 0)
+			return -E_FAULT;
+		gla += n;
+		data = (u8 *)data + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Fetch VT_INSN_MAXLEN bytes at 'rip'; bytes past an unmapped page are 0. */
+static int
+fetch_insn (ulong rip, u8 *code)
+{
+	uint n;
+
+	memset (code, 0, VT_INSN_MAXLEN);
+	n = MIN ((uint)VT_INSN_MAXLEN, (uint)(PAGESIZE - (rip & PAGESIZE_MASK)));
+	if (gla_access (rip, code, n, ACCESS_FETCH) < 0)
+		return -E_FAULT;
+	if (n < VT_INSN_MAXLEN)
+		gla_access (rip + n, code + n, VT_INSN_MAXLEN - n, ACCESS_FETCH);
+	return 0;
+}
+
+/***** Decoder *****/
+
+static u32
+get_le (const u8 **pp, uint size)
+{
+	u32 val = 0;
+	uint i;
+
+	for (i = 0; i < size; i++)
+		val |= (u32)*(*pp)++ << (i * 8);
+	return val;
+}
+
+static u32
+sign_extend8 (u8 val)
+{
+	return (u32)(i32)(i8)val;
+}
+
+static int
+decode_modrm (const u8 **pp, struct vt_insn *insn)
+{
+	static const i8 base16[8] = {
+		GENERAL_REG_RBX, GENERAL_REG_RBX, GENERAL_REG_RBP,
+		GENERAL_REG_RBP, GENERAL_REG_RSI, GENERAL_REG_RDI,
+		GENERAL_REG_RBP, GENERAL_REG_RBX
+	};
+	static const i8 index16[8] = {
+		GENERAL_REG_RSI, GENERAL_REG_RDI, GENERAL_REG_RSI,
+		GENERAL_REG_RDI, -1, -1, -1, -1
+	};
+	u8 modrm, sib, mod, rm;
+
+	modrm = *(*pp)++;
+	mod = modrm >> 6;
+	rm = modrm & 7;
+	insn->reg = (modrm >> 3) & 7;
+
+	/* A register operand never touches memory, so never gets here. */
+	if (mod == 3)
+		return -E_INVAL;
+
+	insn->scale = 1;
+	if (insn->adsize == 2) {
+		if (mod == 0 && rm == 6) {
+			insn->disp = get_le (pp, 2);
+			return 0;
+		}
+		insn->base = base16[rm];
+		insn->index = index16[rm];
+		if (mod == 1)
+			insn->disp = sign_extend8 (*(*pp)++) & 0xFFFF;
+		else if (mod == 2)
+			insn->disp = get_le (pp, 2);
+	} else {
+		if (rm == 4) {
+			sib = *(*pp)++;
+			insn->scale = 1 << (sib >> 6);
+			insn->index = (sib >> 3) & 7;
+			if (insn->index == GENERAL_REG_RSP)
+				insn->index = -1;
+			rm = sib & 7;
+		}
+		if (mod == 0 && rm == 5)
+			insn->disp = get_le (pp, 4);
+		else
+			insn->base = rm;
+		if (mod == 1)
+			insn->disp = sign_extend8 (*(*pp)++);
+		else if (mod == 2)
+			insn->disp = get_le (pp, 4);
+	}
+
+	if (insn->base == GENERAL_REG_RBP || insn->base == GENERAL_REG_RSP)
+		insn->seg = SREG_SS;
+	return 0;
+}
+
+/*
+ * Decode the instruction at 'code'.  'mode' is the default operand and
+ * address size of the code segment.  Returns -E_INVAL for anything
+ * outside the supported subset.
+ */
+static int
+decode (const u8 *code, uint mode, struct vt_insn *insn)
+{
+	const u8 *p = code;
+	int seg_override = -1;
+	bool opsize_override = false, adsize_override = false;
+	u8 opcode;
+
+	memset (insn, 0, sizeof (*insn));
+	insn->base = insn->index = -1;
+	insn->seg = SREG_DS;
+
+	for (;; p++) {
+		if (p - code >= VT_INSN_MAXLEN)
+			return -E_INVAL;
+		switch (*p) {
+		case 0x66: opsize_override = true; continue;
+		case 0x67: adsize_override = true; continue;
+		case 0xF3: insn->rep = 1; continue;
+		case 0x26: seg_override = SREG_ES; continue;
+		case 0x2E: seg_override = SREG_CS; continue;
+		case 0x36: seg_override = SREG_SS; continue;
+		case 0x3E: seg_override = SREG_DS; continue;
+		case 0x64: seg_override = SREG_FS; continue;
+		case 0x65: seg_override = SREG_GS; continue;
+		}
+		break;
+	}
+	insn->adsize = (mode == 4) != adsize_override ? 4 : 2;
+	opcode = *p++;
+	insn->opsize = !(opcode & 1) ? 1 :
+		(mode == 4) != opsize_override ? 4 : 2;
+
+	switch (opcode) {
+	case 0x08: case 0x09: case 0x0A: case 0x0B:
+		insn->op = VT_OP_OR;
+		goto modrm_reg;
+	case 0x20: case 0x21: case 0x22: case 0x23:
+		insn->op = VT_OP_AND;
+		goto modrm_reg;
+	case 0x38: case 0x39: case 0x3A: case 0x3B:
+		insn->op = VT_OP_CMP;
+		goto modrm_reg;
+	case 0x84: case 0x85:
+		insn->op = VT_OP_TEST;
+		goto modrm_reg;
+	case 0x88: case 0x89: case 0x8A: case 0x8B:
+		insn->op = VT_OP_MOV;
+	modrm_reg:
+		/* bit 1 of the opcode selects the register as destination */
+		if (decode_modrm (&p, insn) < 0)
+			return -E_INVAL;
+		if ((opcode & 2) && insn->op != VT_OP_TEST) {
+			insn->dst = VT_OPND_REG;
+			insn->src = VT_OPND_MEM;
+		} else {
+			insn->dst = VT_OPND_MEM;
+			insn->src = VT_OPND_REG;
+		}
+		break;
+
+	case 0x80: case 0x81: case 0x83:
+		if (decode_modrm (&p, insn) < 0)
+			return -E_INVAL;
+		switch (insn->reg) {
+		case 1: insn->op = VT_OP_OR; break;
+		case 4: insn->op = VT_OP_AND; break;
+		case 7: insn->op = VT_OP_CMP; break;
+		default: return -E_INVAL;
+		}
+		if (opcode == 0x83)
+			insn->imm = sign_extend8 (*p++);
+		else
+			insn->imm = get_le (&p, insn->opsize);
+		insn->dst = VT_OPND_MEM;
+		insn->src = VT_OPND_IMM;
+		break;
+
+	case 0xC6: case 0xC7:
+	case 0xF6: case 0xF7:
+		if (decode_modrm (&p, insn) < 0 || insn->reg != 0)
+			return -E_INVAL;
+		insn->op = opcode >= 0xF6 ? VT_OP_TEST : VT_OP_MOV;
+		insn->imm = get_le (&p, insn->opsize);
+		insn->dst = VT_OPND_MEM;
+		insn->src = VT_OPND_IMM;
+		break;
+
+	case 0xA0: case 0xA1: case 0xA2: case 0xA3:
+		/* MOV between the accumulator and a direct offset */
+		insn->op = VT_OP_MOV;
+		insn->reg = GENERAL_REG_RAX;
+		insn->disp = get_le (&p, insn->adsize);
+		if (opcode & 2) {
+			insn->dst = VT_OPND_MEM;
+			insn->src = VT_OPND_REG;
+		} else {
+			insn->dst = VT_OPND_REG;
+			insn->src = VT_OPND_MEM;
+		}
+		break;
+
+	case 0xA4: case 0xA5:
+		insn->op = VT_OP_MOVS;
+		break;
+	case 0xAA: case 0xAB:
+		insn->op = VT_OP_STOS;
+		break;
+
+	default:
+		return -E_INVAL;
+	}
+
+	if (seg_override >= 0)
+		insn->seg = seg_override;
+	if (p - code > VT_INSN_MAXLEN)
+		return -E_INVAL;
+	insn->len = p - code;
+	return 0;
+}
+
+static struct vt_insn *
+insn_lookup (ulong rip, uint mode)
+{
+	struct insn_cache_entry *e;
+	struct code_page *cp;
+	u8 code[VT_INSN_MAXLEN];
+	phys_t gpa;
+
+	if (gla2gpa (rip, &gpa) < 0)
+		return NULL;
+
+	e = &insn_cache[gpa % INSN_CACHE_SIZE];
+	if (e->valid && e->gpa == gpa && e->mode == mode && e->gen != 0 &&
+	    (cp = code_page_find (gpa)) != NULL && cp->protected &&
+	    cp->gen == e->gen) {
+		vt_emulate_stats.ngen_hits++;
+		return &e->insn;
+	}
+
+	if (fetch_insn (rip, code) < 0)
+		return NULL;
+	if (!(e->valid && e->gpa == gpa && e->mode == mode &&
+	      memcmp (e->bytes, code, e->insn.len) == 0)) {
+		e->valid = false;
+		vt_emulate_stats.ndecoded++;
+		if (decode (code, mode, &e->insn) < 0)
+			return NULL;
+		memcpy (e->bytes, code, e->insn.len);
+		e->gpa = gpa;
+		e->mode = mode;
+		e->valid = true;
+	}
+
+	/* Instructions that straddle a page are always compared. */
+	e->gen = 0;
+	if ((gpa & PAGESIZE_MASK) + e->insn.len <= PAGESIZE)
+		e->gen = code_page_protect (gpa);
+	return &e->insn;
+}
+
+/***** Execution *****/
+
+static void
+set_flags (ulong res, uint size, ulong extra)
+{
+	ulong rflags;
+	u8 parity;
+
+	res &= SIZE_MASK (size);
+	rflags = vmcs_read (VMCS_GUEST_RFLAGS) & ~ARITH_FLAGS;
+	if (res == 0)
+		rflags |= RFLAGS_ZF_BIT;
+	if ((res >> (size * 8 - 1)) & 1)
+		rflags |= RFLAGS_SF_BIT;
+	parity = res;
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+	if (!(parity & 1))
+		rflags |= RFLAGS_PF_BIT;
+	asm_vmwrite (VMCS_GUEST_RFLAGS, rflags | extra);
+}
+
+/* Set the flags of 'a - b', as CMP does. */
+static void
+set_flags_sub (ulong a, ulong b, uint size)
+{
+	ulong res, extra = 0;
+
+	res = (a - b) & SIZE_MASK (size);
+	if (a < b)
+		extra |= RFLAGS_CF_BIT;
+	if ((((a ^ b) & (a ^ res)) >> (size * 8 - 1)) & 1)
+		extra |= RFLAGS_OF_BIT;
+	if ((a ^ b ^ res) & 0x10)
+		extra |= RFLAGS_AF_BIT;
+	set_flags (res, size, extra);
+}
+
+static ulong
+effective_addr (struct vt_insn *insn)
+{
+	ulong ea = insn->disp;
+
+	if (insn->base >= 0)
+		ea += reg_read (insn->base, 4);
+	if (insn->index >= 0)
+		ea += reg_read (insn->index, 4) * insn->scale;
+	return seg_base (insn->seg) + (ea & SIZE_MASK (insn->adsize));
+}
+
+static int
+operand_read (struct vt_insn *insn, uint kind, ulong *val)
+{
+	switch (kind) {
+	case VT_OPND_REG:
+		*val = reg_read (insn->reg, insn->opsize);
+		return 0;
+	case VT_OPND_IMM:
+		*val = insn->imm & SIZE_MASK (insn->opsize);
+		return 0;
+	case VT_OPND_MEM:
+		*val = 0;
+		return gla_access (effective_addr (insn), val, insn->opsize,
+				   ACCESS_READ);
+	}
+	return -E_INVAL;
+}
+
+static int
+operand_write (struct vt_insn *insn, uint kind, ulong val)
+{
+	if (kind == VT_OPND_REG) {
+		reg_write (insn->reg, insn->opsize, val);
+		return 0;
+	}
+	return gla_access (effective_addr (insn), &val, insn->opsize,
+			   ACCESS_WRITE);
+}
+
+static int
+execute_string (struct vt_insn *insn)
+{
+	ulong count, si, di, val, step, amask, rflags;
+	ulong src_base, dst_base;
+	int r = 0;
+
+	amask = SIZE_MASK (insn->adsize);
+	rflags = vmcs_read (VMCS_GUEST_RFLAGS);
+	step = (rflags & RFLAGS_DF_BIT) ? -(ulong)insn->opsize : insn->opsize;
+	count = insn->rep ? reg_read (GENERAL_REG_RCX, insn->adsize) : 1;
+	si = reg_read (GENERAL_REG_RSI, insn->adsize);
+	di = reg_read (GENERAL_REG_RDI, insn->adsize);
+	src_base = seg_base (insn->seg);
+	dst_base = seg_base (SREG_ES);	/* no override for the destination */
+
+	for (; count > 0; count--) {
+		val = 0;
+		if (insn->op == VT_OP_MOVS) {
+			if ((r = gla_access (src_base + si, &val, insn->opsize,
+					     ACCESS_READ)) < 0)
+				break;
+		} else
+			val = reg_read (GENERAL_REG_RAX, insn->opsize);
+		if ((r = gla_access (dst_base + di, &val, insn->opsize,
+				     ACCESS_WRITE)) < 0)
+			break;
+		if (insn->op == VT_OP_MOVS)
+			si = (si + step) & amask;
+		di = (di + step) & amask;
+	}
+
+	/* Leave the guest registers consistent with the work done so far. */
+	if (insn->op == VT_OP_MOVS)
+		reg_write (GENERAL_REG_RSI, insn->adsize, si);
+	reg_write (GENERAL_REG_RDI, insn->adsize, di);
+	if (insn->rep)
+		reg_write (GENERAL_REG_RCX, insn->adsize, count);
+	return r;
+}
+
+static int
+execute (struct vt_insn *insn)
+{
+	ulong dst = 0, src, res;
+
+	if (insn->op == VT_OP_MOVS || insn->op == VT_OP_STOS)
+		return execute_string (insn);
+
+	if (operand_read (insn, insn->src, &src) < 0)
+		return -E_FAULT;
+	if (insn->op != VT_OP_MOV &&
+	    operand_read (insn, insn->dst, &dst) < 0)
+		return -E_FAULT;
+
+	switch (insn->op) {
+	case VT_OP_MOV:
+		return operand_write (insn, insn->dst, src);
+	case VT_OP_CMP:
+		set_flags_sub (dst, src, insn->opsize);
+		return 0;
+	case VT_OP_TEST:
+		set_flags (dst & src, insn->opsize, 0);
+		return 0;
+	case VT_OP_AND:
+	case VT_OP_OR:
+		res = insn->op == VT_OP_AND ? dst & src : dst | src;
+		set_flags (res, insn->opsize, 0);
+		return operand_write (insn, insn->dst, res);
+	}
+	return -E_INVAL;
+}
+
+/*
+ * Register an emulated MMIO region.  Its pages are removed from the EPT,
+ * so every guest access exits and is completed by 'handler'.
+ */
+int
+vt_mmio_register (phys_t base, ulong len, vt_mmio_handler_t handler,
+		  void *arg)
+{
+	struct vt_mmio_region *r;
+	ept_entry_t *entry;
+	phys_t gpa;
+	int level;
+
+	if (curvm->nmmio == VT_MAX_MMIO)
+		return -E_NO_MEM;
+
+	for (gpa = base & ~(phys_t)PAGESIZE_MASK; gpa < base + len;
+	     gpa += PAGESIZE) {
+		entry = ept_walk (gpa, &level);
+		if (entry == NULL)
+			continue;
+		if (level != 0)
+			return -E_INVAL;
+		entry->epte = 0;
+	}
+	ept_invalidate ();
+
+	r = &curvm->mmio[curvm->nmmio++];
+	r->base = base;
+	r->len = len;
+	r->handler = handler;
+	r->arg = arg;
+	return 0;
+}
+
+/*
+ * Forget everything cached about the current VM.  Called before
+ * switching to another VM, whose guest physical addresses mean
+ * something else.
+ */
+void
+vt_emulate_flush (void)
+{
+	int i;
+
+	for (i = 0; i < CODE_PAGES; i++) {
+		if (code_pages[i].valid && code_pages[i].protected)
+			ept_set_writable (code_pages[i].gpa, true);
+		code_pages[i].valid = false;
+	}
+	for (i = 0; i < INSN_CACHE_SIZE; i++)
+		insn_cache[i].valid = false;
+	vt_emulate_tlb_flush ();
+	vt_emulate_ept_flush ();
+}
+
+/*
+ * Forget the guest page table translations, as MOV to CR3 does.  With
+ * nothing cached, CR3 loads and INVLPG need not exit any more.
+ */
+void
+vt_emulate_tlb_flush (void)
+{
+	int i;
+
+	for (i = 0; i < GTLB_SIZE; i++)
+		gtlb[i].valid = false;
+	if (gtlb_armed)
+		gtlb_arm (false);
+}
+
+/*
+ * Forget the translations of the guest mapping holding 'gla', as INVLPG
+ * does.  A 4MB or 2MB mapping fills one entry per page used, so every
+ * entry inside it goes, not just the one for the page of 'gla'.
+ */
+void
+vt_emulate_invlpg (ulong gla)
+{
+	int i;
+
+	for (i = 0; i < GTLB_SIZE; i++)
+		if (((gtlb[i].gla ^ gla) & ~gtlb[i].offmask) == 0)
+			gtlb[i].valid = false;
+}
+
+/* Forget the EPT translations.  Called whenever an EPT changes. */
+void
+vt_emulate_ept_flush (void)
+{
+	int i;
+
+	for (i = 0; i < P2M_CACHE_SIZE; i++)
+		p2m_cache[i].valid = false;
+}
+
+/*
+ * Handle a guest write to a code page protected by the decode cache.
+ * Returns false if 'gpa' is not such a page.
+ */
+bool
+vt_emulate_code_write (phys_t gpa)
+{
+	return code_page_unprotect (gpa);
+}
+
+/*
+ * Emulate the guest instruction that faulted on 'gpa'.
+ * Returns false if 'gpa' is not emulated MMIO, or the instruction is
+ * not one the decoder understands or faults.  RIP is then left on the
+ * instruction, but a REP MOVS/STOS that faulted partway keeps the
+ * iterations done before the fault, accounted in RCX, RSI and RDI.
+ */
+bool
+vt_emulate_mmio (phys_t gpa)
+{
+	struct vt_insn *insn;
+	ulong rip, mode;
+
+	if (mmio_find (gpa) == NULL)
+		return false;
+
+	HVPROF_PROBE ();
+	mode = cs_mode ();
+	rip = vmcs_read (VMCS_GUEST_RIP);
+	insn = insn_lookup (seg_base (SREG_CS) + rip, mode);
+	if (insn == NULL) {
+		klog ("vt_emulate: can't decode instruction at %#lx\n", rip);
+		return false;
+	}
+	if (execute (insn) < 0) {
+		klog ("vt_emulate: fault emulating instruction at %#lx\n", rip);
+		return false;
+	}
+
+	vt_emulate_stats.nemulated++;
+	rip += insn->len;
+	if (mode == 2)
+		rip &= 0xFFFF;
+	asm_vmwrite (VMCS_GUEST_RIP, rip);
+	return true;
+}
+
+/* Emulate the instruction at 'rip' of the check code, which must hit MMIO. */
+static void
+check_step (ulong rip, uint len)
+{
+	asm_vmwrite (VMCS_GUEST_RIP, rip);
+	assert (vt_emulate_mmio (DBGCON_BASE));
+	assert (vmcs_read (VMCS_GUEST_RIP) == rip + len);
+}
+
+/*
+ * Run a MOV, a REP MOVS and a REP STOS against the debug console of
+ * curvm, in the real mode a new VM starts in, then check that the
+ * decode cache skips decoding and gives up on a page written too
+ * often.  The VM must not have run yet: the check borrows the first
+ * page of its extended memory, which is still zero, and puts back
+ * everything it changes.
+ */
+void
+vt_emulate_check (void)
+{
+	static const u8 code[] = {
+		0x26, 0x88, 0x05,	/* 0: mov %al,%es:(%di) */
+		0xF3, 0xA4,		/* 3: rep movsb */
+		0xF3, 0xAA,		/* 5: rep stosb */
+		0x26, 0x8B, 0x05,	/* 7: mov %es:(%di),%ax */
+	};
+	static const char str[] = "OVS";
+	static bool checked;
+	struct vt_dbgcon *con = &curvm->dbgcon;
+	struct vt_vmentry_regs regs;
+	ulong rip, cs_base, ds_base, es_base;
+	u8 zero[sizeof (code)];
+	u64 ndecoded, nhits;
+	int i;
+
+	if (checked)
+		return;
+	checked = true;
+
+	regs = curvm->regs;
+	rip = vmcs_read (VMCS_GUEST_RIP);
+	cs_base = seg_base (SREG_CS);
+	ds_base = seg_base (SREG_DS);
+	es_base = seg_base (SREG_ES);
+	asm_vmwrite (VMCS_GUEST_CS_BASE, EXTPHYSMEM);
+	asm_vmwrite (VMCS_GUEST_DS_BASE, EXTPHYSMEM);
+	asm_vmwrite (VMCS_GUEST_ES_BASE, DBGCON_BASE);
+	assert (gpa_access (EXTPHYSMEM, (void *)code, sizeof (code),
+			    ACCESS_WRITE) == 0);
+	assert (gpa_access (EXTPHYSMEM + 0x100, (void *)str, 3,
+			    ACCESS_WRITE) == 0);
+
+	/* MOV: one byte */
+	memset (&curvm->regs, 0, sizeof (curvm->regs));
+	curvm->regs.rax = 'M';
+	check_step (0, 3);
+	assert (con->len == 1 && con->line[0] == 'M');
+
+	/* REP MOVS: three bytes from DS:SI */
+	curvm->regs.rsi = 0x100;
+	curvm->regs.rcx = 3;
+	check_step (3, 2);
+	assert (con->len == 4 && memcmp (con->line, "MOVS", 4) == 0);
+	assert (curvm->regs.rcx == 0 && curvm->regs.rsi == 0x103 &&
+		curvm->regs.rdi == 3);
+
+	/* REP STOS: AL twice */
+	curvm->regs.rax = '!';
+	curvm->regs.rcx = 2;
+	check_step (5, 2);
+	assert (con->len == 6 && memcmp (con->line, "MOVS!!", 6) == 0);
+	assert (curvm->regs.rcx == 0 && curvm->regs.rdi == 5);
+
+	/* MOV from the device: the magic */
+	curvm->regs.rdi = 0;
+	check_step (7, 3);
+	assert ((curvm->regs.rax & 0xFFFF) == (DBGCON_MAGIC & 0xFFFF));
+
+	/* The page is protected now, so running the MOV again won't decode */
+	ndecoded = vt_emulate_stats.ndecoded;
+	nhits = vt_emulate_stats.ngen_hits;
+	check_step (0, 3);
+	assert (vt_emulate_stats.ndecoded == ndecoded);
+	assert (vt_emulate_stats.ngen_hits == ++nhits);
+
+	/*
+	 * After a write the next run compares the bytes and protects the
+	 * page again, until it has been written too often.
+	 */
+	for (i = 1; i <= CODE_PAGE_MAXWRITES; i++) {
+		assert (vt_emulate_code_write (EXTPHYSMEM));
+		check_step (0, 3);
+		assert (vt_emulate_stats.ngen_hits == nhits);
+		assert (ept_walk (EXTPHYSMEM, NULL)->w ==
+			(i == CODE_PAGE_MAXWRITES));
+	}
+	assert (!vt_emulate_code_write (EXTPHYSMEM));
+	assert (vt_emulate_stats.nmixed_pages == 1);
+	assert (vt_emulate_stats.ndecoded == ndecoded);
+
+	memset (zero, 0, sizeof (zero));
+	gpa_access (EXTPHYSMEM, zero, sizeof (code), ACCESS_WRITE);
+	gpa_access (EXTPHYSMEM + 0x100, zero, 3, ACCESS_WRITE);
+	asm_vmwrite (VMCS_GUEST_RIP, rip);
+	asm_vmwrite (VMCS_GUEST_CS_BASE, cs_base);
+	asm_vmwrite (VMCS_GUEST_DS_BASE, ds_base);
+	asm_vmwrite (VMCS_GUEST_ES_BASE, es_base);
+	curvm->regs = regs;
+	memset (con, 0, sizeof (*con));
+	vt_emulate_flush ();
+	memset (&vt_emulate_stats, 0, sizeof (vt_emulate_stats));
+
+	cprintf ("vt_emulate_check() succeeded!\n");
+}
@@ -29,30 +29,29 @@
 
 #include <inc/hvm/vt_ept.h>
 #include <inc/hvm/vt.h>
-
-ept_control g_ept_ctl;
+#include <inc/hvm/vt_vm.h>
+#include <inc/error.h>
 
 static void ept_create_table(struct Page* ept_pml4_page);
 static int ept_update_identity_table ( void* pt, u8 level, gfn_t gfn, u32 p2m_type, u32 op_type);
 
-void ept_setup(void)
+int ept_setup(void)
 {
-	u32 error = 0;
 	int i = 0;
 
 	/* allocate ept PML4 page */
 	struct Page *ept_pml4_page;
 
-	error = page_alloc(&ept_pml4_page);
-	assert(error==0);
-	memset(page2kva(ept_pml4_page), 0, PAGESIZE);
+	if (page_alloc_order(&ept_pml4_page, 0, PAGE_ZERO | PAGE_OWNER(PGO_EPT)) < 0)
+		return -E_NO_MEM;
 	
 	/* set ept */
-	g_ept_ctl.ept_mt = EPT_DEFAULT_MT;
-	g_ept_ctl.ept_wl = EPT_DEFAULT_WL;
-	g_ept_ctl.asr = GFN(page2pa(ept_pml4_page));
+	curvm->ept.ept_mt = EPT_DEFAULT_MT;
+	curvm->ept.ept_wl = EPT_DEFAULT_WL;
+	curvm->ept.asr = GFN(page2pa(ept_pml4_page));
 
 	ept_create_table(ept_pml4_page);
+	return 0;
 }
 static
 void ept_create_table(struct Page *ept_pml4_page)
@@ -102,18 +101,11 @@ ept_update_identity_table (
 			/*Ex3: set the mapping and attributes for all entries*/
 			/* hint: 3B 25 EXTENDED PAGE TABLES (EPT) */
 			/* NOTE: set MTRR_TYPE_UNCACHE to the emt of read only memory address*/
-			/* NOTE: the max memory size of JOS is less than 64MB.
-			 *      To make sure that VM will not overwrite this memory region,
-			 *      we shall give a offset of the mapping of memory address 
-			 *      above 0x0010 0000.(FIXME)
-			 *      Guest PA                PA
-			 *      --------------       ------------
-			 *      |            |    ___|          |
-			 *      --------------   /   ------------0x0400 0000(64MB)
-			 *      |            |__/    |JOS memory|
-			 *      --------------       ----------- 0x0010 0000(1MB)
-			 *      |            |_______|          |
-			 *      --------------       -----------
+			/* NOTE: an identity mapping (guest PA == PA) is enough.
+			 *      Guest RAM is backed by pages of its own, which
+			 *      vm_create() maps over these entries, and the
+			 *      host RAM above it is unmapped again, so the guest
+			 *      can't overwrite JOS memory wherever it lies.
 			 */
 					
 		}
@@ -129,7 +121,8 @@ ept_update_identity_table (
 	{
 		panic("ept_update_identity_table not implemented");
 		/* Ex3: alloc page as sub page table and set the entry */
-		/* hint: page_alloc */
+		/* hint: page_alloc_order(..., PAGE_ZERO | PAGE_OWNER(PGO_EPT))
+		 *       gives a cleared page, accounted to the EPT */
 		/* hint: ept_entry.mfn = GFN(sub_pt_phys); */
   	} 
 	else 
@@ -140,3 +133,108 @@ ept_update_identity_table (
 
 	return ept_update_identity_table ((void *)sub_pt_virt, level-1, gfn, p2m_type, op_type);
 }
+
+/*
+ * Find the leaf entry of 'ept' that maps guest physical address 'gpa'.
+ * Returns NULL if the walk runs into an empty table entry.
+ * If 'level' is not NULL it receives the level of the leaf:
+ * 0 for a 4KB page, 1 for a 2MB superpage.
+ */
+ept_entry_t *
+ept_lookup(ept_control *ept, phys_t gpa, int *level)
+{
+	ept_entry_t *table, *entry;
+	int l;
+
+	table = (ept_entry_t *)KADDR((physaddr_t)(ept->asr << PAGESIZE_SHIFT));
+	for (l = EPT_DEFAULT_WL; ; l--) {
+		entry = &table[(gpa >> (PAGESIZE_SHIFT + l * EPT_TABLE_ORDER))
+			       & (EPT_EACHTABLE_ENTRIES - 1)];
+		if (l == 0 || entry->sp)
+			break;
+		if (entry->epte == 0)
+			return NULL;
+		table = (ept_entry_t *)KADDR((physaddr_t)(entry->mfn << PAGESIZE_SHIFT));
+	}
+
+	if (level)
+		*level = l;
+	return entry;
+}
+
+/* ept_lookup() in the current VM's EPT */
+ept_entry_t *
+ept_walk(phys_t gpa, int *level)
+{
+	return ept_lookup(&curvm->ept, gpa, level);
+}
+
+/*
+ * Translate a guest physical address to the host physical address
+ * backing it.  Returns -E_FAULT if 'gpa' is not readable by the guest.
+ */
+int
+ept_gpa2hpa(phys_t gpa, phys_t *hpa)
+{
+	ept_entry_t *entry;
+	int level;
+	u64 offset_mask;
+
+	entry = ept_walk(gpa, &level);
+	if (entry == NULL || !entry->r)
+		return -E_FAULT;
+
+	offset_mask = (1ULL << (PAGESIZE_SHIFT + level * EPT_TABLE_ORDER)) - 1;
+	*hpa = ((phys_t)entry->mfn << PAGESIZE_SHIFT & ~offset_mask)
+		| (gpa & offset_mask);
+	return 0;
+}
+
+/*
+ * Flush the cached guest-physical mappings derived from 'ept'.
+ * Must be called after any EPT entry loses permissions or changes MFN.
+ */
+void
+ept_invept(ept_control *ept)
+{
+	u64 desc[2];
+
+	desc[0] = ept->eptp;
+	desc[1] = 0;
+	asm_invept(INVEPT_TYPE_SINGLE_CONTEXT, desc);
+	vt_emulate_ept_flush();
+}
+
+/* ept_invept() for the current VM */
+void
+ept_invalidate(void)
+{
+	ept_invept(&curvm->ept);
+}
+
+static void
+ept_free_table(ept_entry_t *table, int level)
+{
+	int i;
+
+	if (level > 0)
+		for (i = 0; i < EPT_EACHTABLE_ENTRIES; i++)
+			if (table[i].epte != 0 && !table[i].sp)
+				ept_free_table((ept_entry_t *)KADDR((physaddr_t)(table[i].mfn << PAGESIZE_SHIFT)),
+					       level - 1);
+	page_free(pa2page(PADDR(table)));
+}
+
+/*
+ * Free every table page of 'ept'.  The guest memory it maps is left
+ * alone.
+ */
+void
+ept_destroy(ept_control *ept)
+{
+	if (ept->eptp == 0)
+		return;
+	ept_free_table((ept_entry_t *)KADDR((physaddr_t)(ept->asr << PAGESIZE_SHIFT)),
+		       ept->ept_wl);
+	ept->eptp = 0;
+}
@@ -30,9 +30,11 @@
 
 #include <inc/hvm/vt_init.h>
 #include <inc/hvm/vt.h>
+#include <inc/hvm/vt_dbgcon.h>
 #include <inc/hvm/vt_ept.h>
-
-extern ept_control g_ept_ctl;
+#include <inc/hvm/vt_pic.h>
+#include <inc/hvm/vt_vga.h>
+#include <inc/hvm/vt_vm.h>
 
 #define DEBUG_PRINT(x) cprintf(#x": %#08x\n", x);
 
@@ -122,7 +124,8 @@ vmx_on (void)
 
 	/* Ex2: alloc vmxon region */
 	/* hint: 20.10.4 VMXON Region */
-	/* hint: page_alloc */
+	/* hint: page_alloc_order (..., PAGE_OWNER (PGO_VMX)), so that
+	 *       meminfo counts it */
 
 
 	/* Ex2: write a VMCS revision identifier */
@@ -170,12 +173,20 @@ set_vmcs_ctl(void)
 	procbased_ctls_or &= ~(VMCS_PROC_BASED_VMEXEC_CTL_CR3LOADEXIT_BIT | 
 			   VMCS_PROC_BASED_VMEXEC_CTL_CR3STOREXIT_BIT);
 
+	/* The VM scheduler switches guests on HLT and on the preemption timer */
+	procbased_ctls |= VMCS_PROC_BASED_VMEXEC_CTL_HLTEXIT_BIT;
+	pinbased_ctls_or |= VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT_TIMER_BIT;
+	exit_ctls_or |= VMCS_VMEXIT_CTL_SAVE_PREEMPT_TIMER_BIT;
+
+	/* PIC port accesses exit, so that the PIC can be given back */
+	procbased_ctls |= VMCS_PROC_BASED_VMEXEC_CTL_USEIOBMP_BIT;
+
 
 	/* 64-Bit Control Fields */
-	asm_vmwrite (VMCS_ADDR_IOBMP_A, 0xFFFFFFFF);
-	asm_vmwrite (VMCS_ADDR_IOBMP_A_HIGH, 0xFFFFFFFF);
-	asm_vmwrite (VMCS_ADDR_IOBMP_B, 0xFFFFFFFF);
-	asm_vmwrite (VMCS_ADDR_IOBMP_B_HIGH, 0xFFFFFFFF);
+	asm_vmwrite (VMCS_ADDR_IOBMP_A, vt_iobmp_pa);
+	asm_vmwrite (VMCS_ADDR_IOBMP_A_HIGH, vt_iobmp_pa >> 32);
+	asm_vmwrite (VMCS_ADDR_IOBMP_B, vt_iobmp_pa + PAGESIZE);
+	asm_vmwrite (VMCS_ADDR_IOBMP_B_HIGH, (vt_iobmp_pa + PAGESIZE) >> 32);
 	asm_vmwrite (VMCS_VMEXIT_MSRSTORE_ADDR, 0);
 	asm_vmwrite (VMCS_VMEXIT_MSRSTORE_ADDR_HIGH, 0);
 	asm_vmwrite (VMCS_VMEXIT_MSRLOAD_ADDR, 0);
@@ -186,8 +197,8 @@ set_vmcs_ctl(void)
 	asm_vmwrite (VMCS_EXEC_VMCS_POINTER_HIGH, 0);
 	asm_vmwrite (VMCS_TSC_OFFSET, 0);
 	asm_vmwrite (VMCS_TSC_OFFSET_HIGH, 0);
-	asm_vmwrite (VMCS_EPT_POINTER,      g_ept_ctl.eptp);
-	asm_vmwrite (VMCS_EPT_POINTER_HIGH, g_ept_ctl.eptp >> 32);
+	asm_vmwrite (VMCS_EPT_POINTER,      curvm->ept.eptp);
+	asm_vmwrite (VMCS_EPT_POINTER_HIGH, curvm->ept.eptp >> 32);
 
 	/* 32-Bit Control Fields */
 	asm_vmwrite (VMCS_PIN_BASED_VMEXEC_CTL,
@@ -326,6 +337,8 @@ vmcs_setup(void)
 	panic("vmcs_setup not implemented");
 	/* Ex4: alloc VMCS region */
 	/* hint: refer to vmx_on() */
+	/* hint: each VM has its own, keep it in curvm->vmcs_page and
+	 *       its physical address in curvm->vmcs_pa */
 
 	/* Ex4: write a VMCS revision identifier */
 	/* hint: 20.2 FORMAT OF THE VMCS REGION */
@@ -342,10 +355,56 @@ vmcs_setup(void)
 	set_vmcs_guest_state(); 
 }
 
+/*
+ * Whether guests can run in real mode and unpaged protected mode.
+ * Guests start in real mode, and without unrestricted guest VM entry
+ * would refuse them; the emulator only completes the MMIO instructions
+ * of guests that run.
+ */
+bool
+vt_has_unrestricted_guest (void)
+{
+	u32 low, high;
+
+	asm_rdmsr32 (MSR_IA32_VMX_PROCBASED_CTLS, &low, &high);
+	if (!(high & VMCS_PROC_BASED_VMEXEC_CTL_ACTIVESECCTL_BIT))
+		return false;
+	asm_rdmsr32 (MSR_IA32_VMX_PROCBASED_CTLS2, &low, &high);
+	return (high & SECONDARY_EXEC_UNRESTRICTED_GUEST) != 0;
+}
+
+u32 vt_preempt_rate;
+
 void
 vt_init (void)
 {
+	static bool vmx_enabled;
+	ulong misc;
+
+	if (vmx_enabled)
+		return;
 	vmx_on();
-	ept_setup();
+	asm_rdmsr(MSR_IA32_VMX_MISC, &misc);
+	vt_preempt_rate = misc & MSR_IA32_VMX_MISC_PREEMPT_RATE_MASK;
+	vmx_enabled = true;
+}
+
+/*
+ * Build the EPT, devices and VMCS of curvm.
+ * VMX must already be on.
+ * Returns 0 on success, < 0 on failure; whatever was built stays in
+ * curvm for vm_destroy() to free.
+ */
+int
+vt_vm_init (void)
+{
+	int r;
+
+	if ((r = ept_setup()) < 0 ||
+	    (r = vt_vga_init()) < 0 ||
+	    (r = vt_dbgcon_init()) < 0 ||
+	    (r = vt_pic_init()) < 0)
+		return r;
 	vmcs_setup();
+	return 0;
 }
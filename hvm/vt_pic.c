@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inc/error.h>
+#include <inc/hvm/vt.h>
+#include <inc/hvm/vt_pic.h>
+#include <inc/hvm/vt_regs.h>
+#include <inc/hvm/vt_vm.h>
+#include <kern/pmap.h>
+
+phys_t vt_iobmp_pa;
+
+static bool
+pic_port (uint port)
+{
+	return (port & ~1) == IO_PIC1 || (port & ~1) == IO_PIC2;
+}
+
+/*
+ * Give curvm the BIOS's PIC, and make the I/O bitmaps, which all VMs
+ * share, the first time.  Returns -E_NO_MEM on memory exhaustion.
+ */
+int
+vt_pic_init (void)
+{
+	struct Page *pp;
+	u8 *bmp;
+	uint port;
+
+	if (vt_iobmp_pa == 0) {
+		if (page_alloc_order (&pp, 1,
+				      PAGE_ZERO | PAGE_OWNER (PGO_VMX)) < 0)
+			return -E_NO_MEM;
+		bmp = page2kva (pp);
+		for (port = 0; port < 0x100; port++)
+			if (pic_port (port))
+				bmp[port / 8] |= 1 << (port % 8);
+		vt_iobmp_pa = page2pa (pp);
+	}
+	pic_bios_regs (curvm->pic.regs);
+	return 0;
+}
+
+/*
+ * An I/O instruction exited, which only PIC port accesses do.  Returns
+ * false, and the VM is stopped, for anything but a byte IN or OUT.
+ */
+bool
+vt_pic_io (void)
+{
+	ulong qual, rax;
+	uint port;
+
+	asm_vmread (VMCS_EXIT_QUALIFICATION, &qual);
+	port = qual >> EXIT_QUAL_IO_PORT_SHIFT;
+	if ((qual & (EXIT_QUAL_IO_SIZE_MASK | EXIT_QUAL_IO_STRING_BIT)) ||
+	    !pic_port (port)) {
+		cprintf ("VM %d: unexpected I/O access %#lx\n", curvm->id, qual);
+		return false;
+	}
+
+	vt_read_general_reg (GENERAL_REG_RAX, &rax);
+	if (qual & EXIT_QUAL_IO_IN_BIT)
+		vt_write_general_reg (GENERAL_REG_RAX,
+				      (rax & ~0xFFUL) | inb (port));
+	else
+		pic_guest_write (curvm->pic.regs, port, rax);
+	return true;
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inc/hvm/vt.h>
+#include <inc/hvm/vt_prof.h>
+#include <inc/error.h>
+#include <kern/cpu.h>
+#include <kern/kdebug.h>
+
+struct hvprof_buf {
+	uint32_t n;			/* samples taken */
+	uint32_t dropped;		/* samples lost to a full buffer */
+	uint32_t exits;			/* armed exits */
+	struct hvprof_sample *open;	/* sample being charged, or NULL */
+	uint64_t t;			/* when 'open' was taken */
+	struct hvprof_sample s[HVPROF_NSAMPLE];
+};
+
+#define HVPROF_NFN	64	/* distinct functions in a report */
+
+bool hvprof_on;
+bool hvprof_armed;
+uint32_t hvprof_period;
+
+static struct hvprof_buf *prof_bufs;	/* NCPU of them */
+static uint32_t prof_count;		/* exits since the last armed one */
+
+int
+hvprof_start (uint32_t period)
+{
+	struct Page *pp;
+	int order, r;
+
+	if (period == 0)
+		return -E_INVAL;
+	if (prof_bufs == NULL) {
+		for (order = 0;
+		     (PGSIZE << order) < NCPU * sizeof (struct hvprof_buf);
+		     order++)
+			;
+		r = page_alloc_order (&pp, order,
+				      PAGE_ZERO | PAGE_OWNER (PGO_KERNEL));
+		if (r < 0)
+			return r;
+		prof_bufs = page2kva (pp);
+	}
+	hvprof_period = period;
+	prof_count = 0;
+	hvprof_on = true;
+	return 0;
+}
+
+void
+hvprof_stop (void)
+{
+	hvprof_on = false;
+}
+
+void
+hvprof_clear (void)
+{
+	if (prof_bufs)
+		memset (prof_bufs, 0, NCPU * sizeof (struct hvprof_buf));
+}
+
+/* Charge the time since the open sample was taken to it. */
+static void
+hvprof_close (struct hvprof_buf *b, uint64_t now)
+{
+	if (b->open) {
+		b->open->cycles = now - b->t;
+		b->open = NULL;
+	}
+}
+
+/* Record the caller's return-address chain and start charging it. */
+void
+hvprof_sample (void)
+{
+	extern char bootstack[], bootstacktop[];
+	struct hvprof_buf *b = &prof_bufs[cpunum ()];
+	struct hvprof_sample *s;
+	uint32_t *ebp;
+	uint64_t now;
+	int i;
+
+	now = read_tsc ();
+	hvprof_close (b, now);
+	if (b->n == HVPROF_NSAMPLE) {
+		b->dropped++;
+		return;
+	}
+	s = &b->s[b->n++];
+	ebp = (uint32_t *)read_ebp ();
+	for (i = 0; i < HVPROF_DEPTH; i++) {
+		/* The kernel and the exit path run on the boot stack. */
+		if ((char *)ebp < bootstack || (char *)ebp >= bootstacktop - 8)
+			break;
+		s->pc[i] = ebp[1];
+		ebp = (uint32_t *)ebp[0];
+	}
+	for (; i < HVPROF_DEPTH; i++)
+		s->pc[i] = 0;
+	b->open = s;
+	b->t = now;
+}
+
+/* Called at every exit; arms every hvprof_period'th one. */
+void
+hvprof_exit_begin (void)
+{
+	if (++prof_count < hvprof_period)
+		return;
+	prof_count = 0;
+	prof_bufs[cpunum ()].exits++;
+	hvprof_armed = true;
+	hvprof_sample ();
+}
+
+void
+hvprof_exit_end (void)
+{
+	if (!hvprof_armed)
+		return;
+	hvprof_armed = false;
+	hvprof_close (&prof_bufs[cpunum ()], read_tsc ());
+}
+
+/* part/total in tenths of a percent, without 64-bit division. */
+static uint32_t
+permille (uint64_t part, uint64_t total)
+{
+	while (total >> 22) {
+		total >>= 1;
+		part >>= 1;
+	}
+	return total ? (uint32_t)part * 1000 / (uint32_t)total : 0;
+}
+
+/*
+ * Symbolize the samples and print, for each function that appears in
+ * them, the share of the sampled time spent in it (total) and in it
+ * with no deeper probe reached (self).
+ */
+void
+hvprof_report (void)
+{
+	static struct {
+		uintptr_t addr;
+		const char *name;
+		int namelen;
+		uint64_t self, total;
+	} fns[HVPROF_NFN], t;
+	struct Eipdebuginfo info;
+	uintptr_t seen[HVPROF_DEPTH];
+	struct hvprof_sample *s;
+	struct hvprof_buf *b;
+	uint32_t nsample = 0, nexit = 0, ndropped = 0;
+	uint64_t sum = 0;
+	int cpu, i, j, k, nfn = 0, other = 0;
+
+	if (prof_bufs == NULL) {
+		cprintf ("hvprof: no samples\n");
+		return;
+	}
+	for (cpu = 0; cpu < NCPU; cpu++) {
+		b = &prof_bufs[cpu];
+		nsample += b->n;
+		nexit += b->exits;
+		ndropped += b->dropped;
+		for (i = 0; i < b->n; i++) {
+			s = &b->s[i];
+			sum += s->cycles;
+			for (j = 0; j < HVPROF_DEPTH && s->pc[j]; j++) {
+				debuginfo_eip (s->pc[j], &info);
+				seen[j] = info.eip_fn_addr;
+				/* Count recursion once. */
+				for (k = 0; k < j && seen[k] != seen[j]; k++)
+					;
+				if (k < j)
+					continue;
+				for (k = 0; k < nfn && fns[k].addr != seen[j]; k++)
+					;
+				if (k == nfn) {
+					if (nfn == HVPROF_NFN) {
+						other++;
+						continue;
+					}
+					fns[nfn].addr = seen[j];
+					fns[nfn].name = info.eip_fn_name;
+					fns[nfn].namelen = info.eip_fn_namelen;
+					fns[nfn].self = fns[nfn].total = 0;
+					nfn++;
+				}
+				fns[k].total += s->cycles;
+				if (j == 0)
+					fns[k].self += s->cycles;
+			}
+		}
+	}
+
+	/* Insertion sort by total time, largest first. */
+	for (i = 1; i < nfn; i++) {
+		t = fns[i];
+		for (j = i; j > 0 && fns[j - 1].total < t.total; j--)
+			fns[j] = fns[j - 1];
+		fns[j] = t;
+	}
+
+	cprintf ("hvprof: %u samples from %u exits, %u dropped\n",
+		 nsample, nexit, ndropped);
+	cprintf ("   total    self  function\n");
+	for (i = 0; i < nfn; i++) {
+		j = permille (fns[i].total, sum);
+		k = permille (fns[i].self, sum);
+		cprintf ("  %3u.%u%%  %3u.%u%%  %.*s\n", j / 10, j % 10,
+			 k / 10, k % 10, fns[i].namelen, fns[i].name);
+	}
+	if (other)
+		cprintf ("  (%u frames in functions past the first %u)\n",
+			 other, HVPROF_NFN);
+}
@@ -29,8 +29,7 @@
  */
 
 #include <inc/hvm/vt_regs.h>
-
-extern struct vt_vmentry_regs vr;
+#include <inc/hvm/vt_vm.h>
 
 void
 get_seg_base (ulong gdtbase, u16 ldtr, u16 sel, ulong *segbase)
@@ -124,28 +123,28 @@ vt_read_general_reg (enum general_reg reg, ulong *val)
 {
 	switch(reg) {
 	case GENERAL_REG_RAX:
-		*val = vr.rax;
+		*val = curvm->regs.rax;
 		break;
 	case GENERAL_REG_RCX:
-		*val = vr.rcx;
+		*val = curvm->regs.rcx;
 		break;
 	case GENERAL_REG_RDX:
-		*val = vr.rdx;
+		*val = curvm->regs.rdx;
 		break;
 	case GENERAL_REG_RBX:
-		*val = vr.rbx;
+		*val = curvm->regs.rbx;
 		break;
 	case GENERAL_REG_RSP:
 		asm_vmread (VMCS_GUEST_RSP, val);
 		break;
 	case GENERAL_REG_RBP:
-		*val = vr.rbp;
+		*val = curvm->regs.rbp;
 		break;
 	case GENERAL_REG_RSI:
-		*val = vr.rsi;
+		*val = curvm->regs.rsi;
 		break;
 	case GENERAL_REG_RDI:
-		*val = vr.rdi;
+		*val = curvm->regs.rdi;
 		break;
 	default:
 		panic ("Fatal error: unknown register.");
@@ -157,28 +156,28 @@ vt_write_general_reg (enum general_reg reg, ulong val)
 {
 	switch(reg) {
 	case GENERAL_REG_RAX:
-		vr.rax = val;
+		curvm->regs.rax = val;
 		break;
 	case GENERAL_REG_RCX:
-		vr.rcx = val;
+		curvm->regs.rcx = val;
 		break;
 	case GENERAL_REG_RDX:
-		vr.rdx = val;
+		curvm->regs.rdx = val;
 		break;
 	case GENERAL_REG_RBX:
-		vr.rbx = val;
+		curvm->regs.rbx = val;
 		break;
 	case GENERAL_REG_RSP:
 		asm_vmwrite (VMCS_GUEST_RSP, val);
 		break;
 	case GENERAL_REG_RBP:
-		vr.rbp = val;
+		curvm->regs.rbp = val;
 		break;
 	case GENERAL_REG_RSI:
-		vr.rsi = val;
+		curvm->regs.rsi = val;
 		break;
 	case GENERAL_REG_RDI:
-		vr.rdi = val;
+		curvm->regs.rdi = val;
 		break;
 	default:
 		panic ("Fatal error: unknown register.");
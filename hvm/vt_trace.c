@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inc/hvm/vt.h>
+#include <inc/hvm/vt_trace.h>
+#include <inc/hvm/vt_vm.h>
+#include <inc/error.h>
+#include <kern/console.h>
+#include <kern/cpu.h>
+
+#define VT_TRACE_NREC	((PGSIZE << VT_TRACE_ORDER) / sizeof (struct vt_trace_rec))
+
+bool vt_trace_on;
+
+static struct vt_trace_rec *trace_ring;	/* NULL until first started */
+static uint32_t trace_head;		/* records written since clear */
+
+int
+vt_trace_start (void)
+{
+	struct Page *pp;
+	int r;
+
+	if (trace_ring == NULL) {
+		r = page_alloc_order (&pp, VT_TRACE_ORDER,
+				      PAGE_OWNER (PGO_KERNEL));
+		if (r < 0)
+			return r;
+		trace_ring = page2kva (pp);
+	}
+	vt_trace_on = true;
+	return 0;
+}
+
+void
+vt_trace_stop (void)
+{
+	vt_trace_on = false;
+}
+
+void
+vt_trace_clear (void)
+{
+	trace_head = 0;
+}
+
+/* Number of records the ring holds. */
+uint32_t
+vt_trace_count (void)
+{
+	return MIN (trace_head, VT_TRACE_NREC);
+}
+
+/*
+ * Claim the next record and fill in what has to be read before the
+ * handler changes it.  Called right after a VM exit.
+ */
+struct vt_trace_rec *
+vt_trace_begin (void)
+{
+	struct vt_trace_rec *rec;
+	ulong reason, qual, rip;
+
+	asm_vmread (VMCS_EXIT_REASON, &reason);
+	asm_vmread (VMCS_EXIT_QUALIFICATION, &qual);
+	asm_vmread (VMCS_GUEST_RIP, &rip);
+
+	rec = &trace_ring[trace_head % VT_TRACE_NREC];
+	rec->reason = reason;
+	rec->qual = qual;
+	rec->rip = rip;
+	rec->vm = curvm->id;
+	rec->cpu = cpunum ();
+	rec->seq = trace_head++;
+	rec->tsc = read_tsc ();
+	return rec;
+}
+
+void
+vt_trace_end (struct vt_trace_rec *rec)
+{
+	rec->cycles = read_tsc () - rec->tsc;
+}
+
+/*
+ * Send the ring, oldest record first, out of the serial port.  Returns
+ * -E_INVAL if there's no serial port to send it to.
+ */
+int
+vt_trace_dump (void)
+{
+	static const char hex[] = "0123456789abcdef";
+	char line[2 + 2 * sizeof (struct vt_trace_rec) + 1];
+	const uint8_t *p;
+	uint32_t i, n;
+	int j, k;
+
+	if (!serial_present ())
+		return -E_INVAL;
+
+	n = vt_trace_count ();
+	k = snprintf (line, sizeof line, "%s %u\n", VT_TRACE_BEGIN, n);
+	serial_write (line, k);
+	for (i = trace_head - n; i != trace_head; i++) {
+		p = (const uint8_t *)&trace_ring[i % VT_TRACE_NREC];
+		k = 0;
+		line[k++] = VT_TRACE_LINE;
+		for (j = 0; j < sizeof (struct vt_trace_rec); j++) {
+			line[k++] = hex[p[j] >> 4];
+			line[k++] = hex[p[j] & 15];
+		}
+		line[k++] = '\n';
+		serial_write (line, k);
+	}
+	k = snprintf (line, sizeof line, "%s\n", VT_TRACE_END);
+	serial_write (line, k);
+	return 0;
+}
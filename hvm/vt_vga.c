@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inc/hvm/vt.h>
+#include <inc/hvm/vt_ept.h>
+#include <inc/hvm/vt_prof.h>
+#include <inc/hvm/vt_vga.h>
+#include <inc/hvm/vt_vm.h>
+#include <inc/error.h>
+#include <kern/console.h>
+
+/*
+ * Each VM's VGA text buffer lives in ordinary RAM pages mapped over
+ * 0xB8000-0xBFFFF in its EPT, so guest writes never touch the host
+ * screen and never exit.  All its pages are write-protected after
+ * every sync; the first write after that exits once, marks the buffer
+ * dirty and unprotects them.  vt_vga_sync() then diffs every page
+ * against the host's buffer and copies only the changed cells, so the
+ * screen is right whichever page the guest has the CRTC show.  Only the
+ * console VM is shown.
+ */
+
+/* Don't sync more often than this many TSC ticks. */
+#define VGA_SYNC_INTERVAL	(1ULL << 24)
+
+#define PAGE_CELLS	(PAGESIZE / sizeof (u16))
+
+/* What the host's text buffer currently holds */
+static u16 vga_shadow[VGA_TEXT_PAGES * PAGE_CELLS];
+
+static void
+vga_protect (bool protect)
+{
+	ept_entry_t *entry;
+	int i, level;
+
+	for (i = 0; i < VGA_TEXT_PAGES; i++) {
+		entry = ept_walk (VGA_TEXT_BASE + i * PAGESIZE, &level);
+		assert (entry != NULL && level == 0);
+		entry->w = !protect;
+	}
+	ept_invalidate ();
+}
+
+/* Copy the cells of 'vm' that differ from the host's text buffer. */
+static void
+vga_blit (struct vm *vm)
+{
+	u16 *buf, *shadow;
+	int i, page, start;
+
+	for (page = 0; page < VGA_TEXT_PAGES; page++) {
+		buf = kmap (vm_page (vm, VGA_TEXT_BASE + page * PAGESIZE));
+		shadow = vga_shadow + page * PAGE_CELLS;
+		for (i = 0; i < PAGE_CELLS; ) {
+			if (buf[i] == shadow[i]) {
+				i++;
+				continue;
+			}
+			start = i;
+			while (i < PAGE_CELLS && buf[i] != shadow[i]) {
+				shadow[i] = buf[i];
+				i++;
+			}
+			cga_write (page * PAGE_CELLS + start, shadow + start,
+				   i - start);
+		}
+		kunmap (buf);
+	}
+}
+
+/*
+ * Give curvm its text buffer, a copy of the host screen.
+ * Returns -E_NO_MEM on memory exhaustion.
+ */
+int
+vt_vga_init (void)
+{
+	struct vt_vga *vga = &curvm->vga;
+	struct Page *pp;
+	ept_entry_t *entry;
+	phys_t gpa;
+	void *buf;
+	int i, level;
+
+	for (i = 0; i < VGA_TEXT_PAGES; i++) {
+		gpa = VGA_TEXT_BASE + i * PAGESIZE;
+		entry = ept_walk (gpa, &level);
+		if (entry == NULL || level != 0)
+			panic ("vt_vga_init: VGA text buffer is not mapped by 4K EPT pages");
+		if (vm_page (curvm, gpa) == NULL) {
+			if (page_alloc_order (&pp, 0,
+					      PAGE_ZERO | PAGE_OWNER (PGO_DEVICE)) < 0)
+				return -E_NO_MEM;
+			vm_set_page (curvm, gpa, pp);
+		}
+	}
+
+	/* Start from what the host holds, so the first sync is a no-op. */
+	cga_read (0, vga_shadow, sizeof (vga_shadow) / sizeof (vga_shadow[0]));
+	for (i = 0; i < VGA_TEXT_PAGES; i++) {
+		buf = kmap (vm_page (curvm, VGA_TEXT_BASE + i * PAGESIZE));
+		memcpy (buf, vga_shadow + i * PAGE_CELLS, PAGESIZE);
+		kunmap (buf);
+	}
+	vga->dirty = false;
+	vga->last_sync = read_tsc ();
+	vga_protect (true);
+	return 0;
+}
+
+/*
+ * Handle an EPT write violation on the guest text buffer.
+ * Returns false if 'gpa' is not in it.
+ */
+bool
+vt_vga_write_fault (phys_t gpa)
+{
+	if (gpa < VGA_TEXT_BASE ||
+	    gpa >= VGA_TEXT_BASE + VGA_TEXT_PAGES * PAGESIZE)
+		return false;
+	curvm->vga.dirty = true;
+	vga_protect (false);
+	return true;
+}
+
+/*
+ * Copy the cells the current VM changed since the last sync to the host
+ * screen.  Unless 'force', this is rate-limited to VGA_SYNC_INTERVAL.
+ */
+void
+vt_vga_sync (bool force)
+{
+	struct vt_vga *vga = &curvm->vga;
+	u64 now;
+
+	if (!vga->dirty || curvm != vm_console)
+		return;
+	now = read_tsc ();
+	if (!force && now - vga->last_sync < VGA_SYNC_INTERVAL)
+		return;
+	HVPROF_PROBE ();
+
+	/* Re-arm the protection first so no write can slip past the diff. */
+	vga->dirty = false;
+	vga->last_sync = now;
+	vga_protect (true);
+	vga_blit (curvm);
+}
+
+/* Make 'vm' the VM shown on the host screen. */
+void
+vt_vga_show (struct vm *vm)
+{
+	vm_console = vm;
+	if (vm != NULL)
+		vga_blit (vm);
+}
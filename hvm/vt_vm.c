@@ -0,0 +1,580 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <inc/hvm/vt.h>
+#include <inc/hvm/vt_ept.h>
+#include <inc/hvm/vt_emulate.h>
+#include <inc/hvm/vt_prof.h>
+#include <inc/hvm/vt_vga.h>
+#include <inc/hvm/vt_vm.h>
+#include <inc/error.h>
+#include <kern/kmem.h>
+
+struct vm *vms[NVM];
+struct vm *curvm;
+struct vm *vm_console;
+bool vm_escape;
+
+static struct kmem_cache *vm_cache;
+
+static int next_vm_id = 1;
+
+/*
+ * Return the host page backing guest page 'gpa' of 'vm', or NULL if
+ * the VM doesn't own a page there.
+ */
+struct Page *
+vm_page (struct vm *vm, phys_t gpa)
+{
+	ept_entry_t *entry;
+	int level;
+
+	entry = ept_lookup (&vm->ept, gpa, &level);
+	if (entry == NULL || level != 0 || !(entry->avail1 & EPT_AVAIL_PRIVATE))
+		return NULL;
+	return pa2page ((physaddr_t)entry->mfn << PAGESIZE_SHIFT);
+}
+
+/*
+ * Back guest page 'gpa' of 'vm' with 'pp'.  The VM takes a reference
+ * to 'pp' and drops the one it held on the page it replaces.  Access
+ * rights are left alone; the caller invalidates the EPT.
+ */
+void
+vm_set_page (struct vm *vm, phys_t gpa, struct Page *pp)
+{
+	struct Page *old;
+	ept_entry_t *entry;
+	int level;
+
+	old = vm_page (vm, gpa);
+	entry = ept_lookup (&vm->ept, gpa, &level);
+	assert (entry != NULL && level == 0);
+	pp->pp_ref++;
+	if (old != NULL)
+		page_decref (old);
+	entry->mfn = GFN (page2pa (pp));
+	entry->avail1 = EPT_AVAIL_PRIVATE;
+}
+
+/*
+ * Back [start, end) of curvm with new pages, copied from host memory or
+ * zeroed.  The host never needs guest RAM mapped for long, so it comes
+ * from high memory first.
+ */
+static int
+vm_map_ram (phys_t start, phys_t end, bool copy)
+{
+	struct Page *pp;
+	phys_t gpa;
+	void *va;
+
+	for (gpa = start; gpa < end; gpa += PAGESIZE) {
+		if (page_alloc_order (&pp, 0, PAGE_HIGH | PAGE_OWNER (PGO_GUEST) |
+				      (copy ? 0 : PAGE_ZERO)) < 0)
+			return -E_NO_MEM;
+		if (copy) {
+			va = kmap (pp);
+			memcpy (va, KADDR (gpa), PAGESIZE);
+			kunmap (va);
+		}
+		vm_set_page (curvm, gpa, pp);
+	}
+	return 0;
+}
+
+/*
+ * Give curvm its own RAM.  Conventional memory is a copy of the host's,
+ * so that the guest sees the BIOS data, and guests booting side by side
+ * don't share the boot sector and its stack.  Extended memory up to
+ * memsize starts out zeroed.  Any page the allocator has will do, so
+ * guests can be handed all the RAM the machine has.
+ */
+static int
+vm_map_mem (void)
+{
+	int r;
+
+	if ((r = vm_map_ram (0, IOPHYSMEM, true)) < 0 ||
+	    (r = vm_map_ram (EXTPHYSMEM, curvm->memsize, false)) < 0)
+		return r;
+	ept_invalidate ();
+	return 0;
+}
+
+/*
+ * Unmap the guest-physical addresses above curvm's memory that the
+ * identity mapping points at host RAM, which belongs to the host and
+ * the other VMs.
+ */
+static void
+vm_hide_host_ram (void)
+{
+	ept_entry_t *entry;
+	phys_t gpa;
+	int level;
+
+	for (gpa = curvm->memsize; gpa < (phys_t)npages * PGSIZE;
+	     gpa += PAGESIZE) {
+		entry = ept_walk (gpa, &level);
+		if (entry != NULL && level == 0)
+			entry->epte = 0;
+	}
+	ept_invalidate ();
+}
+
+/*
+ * Allocate a VM slot and build its EPT, devices and VMCS.
+ * The new VM becomes the current VM but is not runnable yet.
+ * It only takes the slot once it is built.
+ */
+static int
+vm_alloc (struct vm **vm_store)
+{
+	struct vm *vm;
+	int i, r;
+
+	vt_init ();
+	if (!vt_has_unrestricted_guest ())
+		return -E_NOT_SUPP;
+	for (i = 0; i < NVM; i++)
+		if (vms[i] == NULL)
+			break;
+	if (i == NVM)
+		return -E_NO_FREE_ENV;
+	if (vm_cache == NULL &&
+	    (vm_cache = kmem_cache_create ("vm", sizeof (struct vm),
+					   CACHELINE, NULL)) == NULL)
+		return -E_NO_MEM;
+	if ((vm = kmem_cache_alloc (vm_cache)) == NULL)
+		return -E_NO_MEM;
+
+	if (curvm != NULL)
+		vt_emulate_flush ();
+	memset (vm, 0, sizeof (*vm));
+	vm->id = next_vm_id++;
+	vm->memsize = VM_MEM_SIZE;
+	curvm = vm;
+
+	if ((r = vt_vm_init ()) < 0) {
+		vm_destroy (vm);
+		return r;
+	}
+	vm_hide_host_ram ();
+	vms[i] = vm;
+	*vm_store = vm;
+	return 0;
+}
+
+/*
+ * Allocate and initialize a new VM, and make it the current and the
+ * console VM.  The guest starts at 0x7c00 in real mode.
+ * Returns 0 on success, < 0 on failure:
+ *	-E_NO_FREE_ENV if all NVM VMs are in use
+ *	-E_NO_MEM on memory exhaustion
+ *	-E_NOT_SUPP if the CPU can't run real-mode guests
+ */
+int
+vm_create (struct vm **vm_store)
+{
+	struct vm *vm;
+	int r;
+
+	if ((r = vm_alloc (&vm)) < 0)
+		return r;
+	if ((r = vm_map_mem ()) < 0) {
+		vm_destroy (vm);
+		return r;
+	}
+	vt_emulate_check ();
+
+	vm->state = VM_RUNNABLE;
+	vt_vga_show (vm);
+	*vm_store = vm;
+	return 0;
+}
+
+/* Map 'pp' at 'gpa' of 'vm' read-only and copy-on-write. */
+static void
+vm_share_page (struct vm *vm, phys_t gpa, struct Page *pp)
+{
+	ept_entry_t *entry;
+	int level;
+
+	vm_set_page (vm, gpa, pp);
+	entry = ept_lookup (&vm->ept, gpa, &level);
+	entry->w = 0;
+	entry->avail1 |= EPT_AVAIL_COW;
+}
+
+/*
+ * Give the current VM its own copy of the copy-on-write page at 'gpa'.
+ * Returns 1 if the page was copy-on-write, -E_NO_MEM if the copy could
+ * not be allocated, and 0 otherwise, which makes this safe to call
+ * before any write to guest memory.
+ */
+int
+vm_cow_fault (phys_t gpa)
+{
+	struct Page *shared, *pp;
+	ept_entry_t *entry;
+	void *dst, *src;
+	int level;
+
+	entry = ept_walk (gpa, &level);
+	if (entry == NULL || level != 0 || !(entry->avail1 & EPT_AVAIL_COW))
+		return 0;
+	HVPROF_PROBE ();
+	shared = vm_page (curvm, gpa);
+	assert (shared != NULL);
+
+	/* The last user of a shared page just takes it over. */
+	if (shared->pp_ref > 1) {
+		if (page_alloc_order (&pp, 0,
+				      PAGE_HIGH | PAGE_OWNER (PGO_GUEST)) < 0)
+			return -E_NO_MEM;
+		dst = kmap (pp);
+		src = kmap (shared);
+		memcpy (dst, src, PAGESIZE);
+		kunmap (src);
+		kunmap (dst);
+		vm_set_page (curvm, gpa, pp);
+	}
+	entry->avail1 &= ~EPT_AVAIL_COW;
+	entry->w = 1;
+	ept_invalidate ();
+	return 1;
+}
+
+/*
+ * Give guest page 'gpa' of 'vm' back to the host.  The EPT entry stays,
+ * not present, so that the page can be faulted back in.
+ */
+static void
+vm_balloon_unmap (struct vm *vm, phys_t gpa)
+{
+	struct Page *pp;
+	ept_entry_t *entry;
+	int level;
+
+	pp = vm_page (vm, gpa);
+	entry = ept_lookup (&vm->ept, gpa, &level);
+	assert (entry != NULL && level == 0);
+	entry->r = entry->w = entry->x = 0;
+	entry->mfn = 0;
+	entry->avail1 = EPT_AVAIL_BALLOON;
+	if (pp != NULL)
+		page_decref (pp);
+	vm->nballoon++;
+}
+
+/* Give a ballooned page of curvm a new zeroed page. */
+static int
+vm_balloon_map (phys_t gpa)
+{
+	struct Page *pp;
+	ept_entry_t *entry;
+
+	if (page_alloc_order (&pp, 0, PAGE_HIGH | PAGE_ZERO |
+			      PAGE_OWNER (PGO_GUEST)) < 0)
+		return -E_NO_MEM;
+	vm_set_page (curvm, gpa, pp);
+	entry = ept_walk (gpa, NULL);
+	entry->r = entry->w = entry->x = 1;
+	curvm->nballoon--;
+	return 0;
+}
+
+/*
+ * Balloon hypercall: inflate (give back) or deflate (take again) the
+ * guest frames listed at guest physical address 'list'.  Frames that
+ * aren't guest RAM, or are already in the requested state, are skipped.
+ * The EPT is invalidated once for the whole batch.
+ * Returns the number of frames changed, or < 0 on failure:
+ *	-E_INVAL if the list crosses a page
+ *	-E_FAULT if the list is not in guest memory
+ */
+int
+vm_balloon (bool inflate, phys_t list, uint count)
+{
+	u32 gfns[64];
+	ept_entry_t *entry;
+	phys_t gpa;
+	uint i, n;
+	int r = 0, done;
+
+	if (count > (PAGESIZE - (list & PAGESIZE_MASK)) / sizeof (gfns[0]))
+		return -E_INVAL;
+
+	/* The decode cache may have write-protected the frames. */
+	vt_emulate_flush ();
+	done = 0;
+	for (; count > 0; count -= n, list += n * sizeof (gfns[0])) {
+		n = MIN (count, sizeof (gfns) / sizeof (gfns[0]));
+		if ((r = vt_gpa_read (list, gfns, n * sizeof (gfns[0]))) < 0)
+			break;
+		for (i = 0; i < n; i++) {
+			gpa = (phys_t)gfns[i] << PAGESIZE_SHIFT;
+			if (gpa >= curvm->memsize ||
+			    (gpa >= VGA_TEXT_BASE &&
+			     gpa < VGA_TEXT_BASE + VGA_TEXT_PAGES * PAGESIZE))
+				continue;
+			if (inflate && vm_page (curvm, gpa) != NULL) {
+				vm_balloon_unmap (curvm, gpa);
+				done++;
+			} else if (!inflate &&
+				   (entry = ept_walk (gpa, NULL)) != NULL &&
+				   (entry->avail1 & EPT_AVAIL_BALLOON)) {
+				if ((r = vm_balloon_map (gpa)) < 0)
+					break;
+				done++;
+			}
+		}
+		if (i < n)
+			break;
+	}
+	ept_invalidate ();
+	return done > 0 ? done : r;
+}
+
+/*
+ * Handle an EPT violation on a ballooned page by giving it back.
+ * Returns 1 if 'gpa' was ballooned, 0 if not, or -E_NO_MEM.
+ */
+int
+vm_balloon_fault (phys_t gpa)
+{
+	ept_entry_t *entry;
+	int r;
+
+	entry = ept_walk (gpa, NULL);
+	if (entry == NULL || !(entry->avail1 & EPT_AVAIL_BALLOON))
+		return 0;
+	if ((r = vm_balloon_map (gpa)) < 0)
+		return r;
+	ept_invalidate ();
+	return 1;
+}
+
+/* Guest-state fields set up by set_vmcs_guest_state() */
+static const u32 vmcs_guest_fields[] = {
+	VMCS_GUEST_ES_SEL, VMCS_GUEST_CS_SEL, VMCS_GUEST_SS_SEL,
+	VMCS_GUEST_DS_SEL, VMCS_GUEST_FS_SEL, VMCS_GUEST_GS_SEL,
+	VMCS_GUEST_LDTR_SEL, VMCS_GUEST_TR_SEL,
+	VMCS_VMCS_LINK_POINTER, VMCS_VMCS_LINK_POINTER_HIGH,
+	VMCS_GUEST_IA32_DEBUGCTL, VMCS_GUEST_IA32_DEBUGCTL_HIGH,
+	VMCS_GUEST_PDPTE0, VMCS_GUEST_PDPTE0_HIGH,
+	VMCS_GUEST_PDPTE1, VMCS_GUEST_PDPTE1_HIGH,
+	VMCS_GUEST_PDPTE2, VMCS_GUEST_PDPTE2_HIGH,
+	VMCS_GUEST_PDPTE3, VMCS_GUEST_PDPTE3_HIGH,
+	VMCS_GUEST_ES_LIMIT, VMCS_GUEST_CS_LIMIT, VMCS_GUEST_SS_LIMIT,
+	VMCS_GUEST_DS_LIMIT, VMCS_GUEST_FS_LIMIT, VMCS_GUEST_GS_LIMIT,
+	VMCS_GUEST_LDTR_LIMIT, VMCS_GUEST_TR_LIMIT,
+	VMCS_GUEST_GDTR_LIMIT, VMCS_GUEST_IDTR_LIMIT,
+	VMCS_GUEST_ES_ACCESS_RIGHTS, VMCS_GUEST_CS_ACCESS_RIGHTS,
+	VMCS_GUEST_SS_ACCESS_RIGHTS, VMCS_GUEST_DS_ACCESS_RIGHTS,
+	VMCS_GUEST_FS_ACCESS_RIGHTS, VMCS_GUEST_GS_ACCESS_RIGHTS,
+	VMCS_GUEST_LDTR_ACCESS_RIGHTS, VMCS_GUEST_TR_ACCESS_RIGHTS,
+	VMCS_GUEST_INTERRUPTIBILITY_STATE, VMCS_GUEST_ACTIVITY_STATE,
+	VMCS_GUEST_IA32_SYSENTER_CS,
+	VMCS_GUEST_CR0, VMCS_GUEST_CR3, VMCS_GUEST_CR4,
+	VMCS_GUEST_ES_BASE, VMCS_GUEST_CS_BASE, VMCS_GUEST_SS_BASE,
+	VMCS_GUEST_DS_BASE, VMCS_GUEST_FS_BASE, VMCS_GUEST_GS_BASE,
+	VMCS_GUEST_LDTR_BASE, VMCS_GUEST_TR_BASE,
+	VMCS_GUEST_GDTR_BASE, VMCS_GUEST_IDTR_BASE,
+	VMCS_GUEST_DR7, VMCS_GUEST_RSP, VMCS_GUEST_RIP, VMCS_GUEST_RFLAGS,
+	VMCS_GUEST_PENDING_DEBUG_EXCEPTIONS,
+	VMCS_GUEST_IA32_SYSENTER_ESP, VMCS_GUEST_IA32_SYSENTER_EIP,
+};
+
+#define NGUEST_FIELDS	(sizeof (vmcs_guest_fields) / sizeof (vmcs_guest_fields[0]))
+
+/*
+ * Clone 'src': its VMCS guest state, registers and private memory.
+ * The memory is shared copy-on-write, so only pages either side later
+ * writes get copied.  The clone is left paused.
+ */
+int
+vm_fork (struct vm *src, struct vm **vm_store)
+{
+	ulong guest_state[NGUEST_FIELDS];
+	ept_entry_t *entry;
+	struct Page *pp;
+	struct vm *vm;
+	phys_t gpa;
+	int i, r;
+
+	/* Drop the decode cache's write protection before sharing pages. */
+	vm_switch (src);
+	vt_emulate_flush ();
+	for (i = 0; i < NGUEST_FIELDS; i++)
+		asm_vmread (vmcs_guest_fields[i], &guest_state[i]);
+
+	if ((r = vm_alloc (&vm)) < 0)
+		return r;
+	for (i = 0; i < NGUEST_FIELDS; i++)
+		asm_vmwrite (vmcs_guest_fields[i], guest_state[i]);
+	vm->regs = src->regs;
+	vm->pic = src->pic;
+
+	for (gpa = 0; gpa < src->memsize; gpa += PAGESIZE) {
+		if ((pp = vm_page (src, gpa)) != NULL) {
+			vm_share_page (src, gpa, pp);
+			vm_share_page (vm, gpa, pp);
+		} else if ((entry = ept_lookup (&src->ept, gpa, NULL)) != NULL &&
+			   (entry->avail1 & EPT_AVAIL_BALLOON))
+			vm_balloon_unmap (vm, gpa);
+	}
+	ept_invept (&src->ept);
+	ept_invept (&vm->ept);
+
+	vm->state = VM_PAUSED;
+	*vm_store = vm;
+	return 0;
+}
+
+/* Free a VM and everything it owns, even if it was only partly built. */
+void
+vm_destroy (struct vm *vm)
+{
+	struct Page *pp;
+	phys_t gpa;
+	int i;
+
+	if (vm == curvm) {
+		vt_emulate_flush ();
+		curvm = NULL;
+	}
+	if (vm->vmcs_page != NULL) {
+		asm_vmclear (&vm->vmcs_pa);
+		page_free (vm->vmcs_page);
+	}
+	if (vm->ept.eptp != 0)
+		for (gpa = 0; gpa < vm->memsize; gpa += PAGESIZE)
+			if ((pp = vm_page (vm, gpa)) != NULL)
+				page_decref (pp);
+	ept_destroy (&vm->ept);
+	vm->state = VM_FREE;
+	for (i = 0; i < NVM; i++)
+		if (vms[i] == vm)
+			vms[i] = NULL;
+
+	if (vm == vm_console) {
+		vt_vga_show (NULL);
+		for (i = 0; i < NVM; i++)
+			if (vms[i] != NULL) {
+				vt_vga_show (vms[i]);
+				break;
+			}
+	}
+	kmem_cache_free (vm_cache, vm);
+}
+
+struct vm *
+vm_lookup (int id)
+{
+	int i;
+
+	for (i = 0; i < NVM; i++)
+		if (vms[i] != NULL && vms[i]->id == id)
+			return vms[i];
+	return NULL;
+}
+
+/* Load the VMCS of 'vm' and make it the current VM. */
+void
+vm_switch (struct vm *vm)
+{
+	if (vm == curvm)
+		return;
+	if (curvm != NULL)
+		vt_emulate_flush ();
+	curvm = vm;
+	asm_vmptrld (&vm->vmcs_pa);
+}
+
+/*
+ * Whether some VM is runnable, after waking the halted VMs if none was.
+ */
+static bool
+vm_sched_runnable (void)
+{
+	bool halted = false;
+	int i;
+
+	for (i = 0; i < NVM; i++)
+		if (vms[i] != NULL) {
+			if (vms[i]->state == VM_RUNNABLE)
+				return true;
+			halted |= vms[i]->state == VM_HALTED;
+		}
+	if (!halted)
+		return false;
+	for (i = 0; i < NVM; i++)
+		if (vms[i] != NULL && vms[i]->state == VM_HALTED)
+			vms[i]->state = VM_RUNNABLE;
+	return true;
+}
+
+/*
+ * Round-robin over the runnable VMs, one time slice each, until none is
+ * runnable or halted, or a guest makes the HC_HOST_MONITOR hypercall.
+ * Halted VMs are woken when there is nothing else to run.  The keyboard
+ * and serial port belong to the guests meanwhile, so the host doesn't
+ * look at them.
+ */
+void
+vm_sched (void)
+{
+	struct vm *vm;
+	int i, last;
+
+	for (last = NVM - 1; last > 0; last--)
+		if (curvm != NULL && vms[last] == curvm)
+			break;
+	vm_escape = false;
+	for (;;) {
+		vm = NULL;
+		if (!vm_sched_runnable ())
+			break;
+		for (i = 1; i <= NVM; i++)
+			if (vms[(last + i) % NVM] != NULL &&
+			    vms[(last + i) % NVM]->state == VM_RUNNABLE) {
+				vm = vms[(last + i) % NVM];
+				last = (last + i) % NVM;
+				break;
+			}
+		assert (vm != NULL);
+
+		vm_switch (vm);
+		vt_run_slice ();
+		if (vm_escape)
+			break;
+	}
+}
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <inc/hvm/vt_trace.h>
+
+/* This program decodes a VM exit trace.
+ * Its input is a capture of the serial port holding the output of the
+ * monitor's "vtrace dump" command; anything outside the dump is skipped,
+ * and if there are several dumps the last one is used.
+ *
+ * By default it prints, for each exit reason, the number of exits and
+ * the time spent handling them, then a timeline showing when each kind
+ * of exit happened.  With -f it prints instead one "vm;reason;rip cycles"
+ * line per distinct exit site, the folded format read by flamegraph.pl.
+ *
+ * It runs on the build host, like mkbootdisk.
+ */
+
+#define NREASON	64
+#define WIDTH	64	/* default timeline width */
+
+static const char *reason_name[NREASON] = {
+	[0x00] "EXCEPTION_OR_NMI",
+	[0x01] "EXTERNAL_INT",
+	[0x02] "TRIPLE_FAULT",
+	[0x03] "INIT_SIGNAL",
+	[0x04] "STARTUP_IPI",
+	[0x05] "IO_SMI",
+	[0x06] "OTHER_SMI",
+	[0x07] "INTERRUPT_WINDOW",
+	[0x09] "TASK_SWITCH",
+	[0x0A] "CPUID",
+	[0x0C] "HLT",
+	[0x0D] "INVD",
+	[0x0E] "INVLPG",
+	[0x0F] "RDPMC",
+	[0x10] "RDTSC",
+	[0x11] "RSM",
+	[0x12] "VMCALL",
+	[0x13] "VMCLEAR",
+	[0x14] "VMLAUNCH",
+	[0x15] "VMPTRLD",
+	[0x16] "VMPTRST",
+	[0x17] "VMREAD",
+	[0x18] "VMRESUME",
+	[0x19] "VMWRITE",
+	[0x1A] "VMXOFF",
+	[0x1B] "VMXON",
+	[0x1C] "MOV_CR",
+	[0x1D] "MOV_DR",
+	[0x1E] "IO_INSTRUCTION",
+	[0x1F] "RDMSR",
+	[0x20] "WRMSR",
+	[0x21] "ENTFAIL_GUEST_STATE",
+	[0x22] "ENTFAIL_MSR_LOADING",
+	[0x24] "MWAIT",
+	[0x25] "MTF",
+	[0x27] "MONITOR",
+	[0x28] "PAUSE",
+	[0x29] "ENTFAIL_MACHINE_CHK",
+	[0x2B] "TPR_BELOW_THRESHOLD",
+	[0x2C] "APIC_ACCESS",
+	[0x2E] "ACCESS_GDTR_OR_IDTR",
+	[0x2F] "ACCESS_LDTR_OR_TR",
+	[0x30] "EPT_VIOLATION",
+	[0x31] "EPT_MISCONFIG",
+	[0x32] "INVEPT",
+	[0x33] "RDTSCP",
+	[0x34] "VMX_PREEMPT_TIMER",
+	[0x35] "INVVPID",
+	[0x36] "WBINVD",
+	[0x37] "XSETBV",
+};
+
+struct rstat {
+	unsigned long count;
+	uint64_t cycles;
+	uint32_t min, max;
+	unsigned long *buckets;
+};
+
+static struct vt_trace_rec *recs;
+static size_t nrecs, maxrecs;
+
+void
+usage(void)
+{
+	fprintf(stderr, "Usage: vtdecode [-f] [-w WIDTH] [FILE]\n");
+	exit(1);
+}
+
+static unsigned
+reason_index(uint32_t reason)
+{
+	reason &= 0xFFFF;
+	return reason < NREASON ? reason : NREASON - 1;
+}
+
+static const char *
+reason_str(unsigned r)
+{
+	static char buf[16];
+
+	if (r < NREASON && reason_name[r])
+		return reason_name[r];
+	sprintf(buf, "REASON_%#x", r);
+	return buf;
+}
+
+static uint64_t
+get_le(const uint8_t *p, int n)
+{
+	uint64_t v = 0;
+
+	while (n-- > 0)
+		v = (v << 8) | p[n];
+	return v;
+}
+
+// Decode one "T<hex>" line into a record.  Returns 0, or -1 if the line
+// is malformed.
+static int
+parse_rec(const char *s, struct vt_trace_rec *rec)
+{
+	uint8_t b[sizeof(struct vt_trace_rec)];
+	int i, hi, lo;
+
+	for (i = 0; i < sizeof(b); i++) {
+		if (!isxdigit((unsigned char) s[2*i])
+		    || !isxdigit((unsigned char) s[2*i + 1]))
+			return -1;
+		hi = isdigit((unsigned char) s[2*i]) ? s[2*i] - '0'
+			: tolower((unsigned char) s[2*i]) - 'a' + 10;
+		lo = isdigit((unsigned char) s[2*i + 1]) ? s[2*i + 1] - '0'
+			: tolower((unsigned char) s[2*i + 1]) - 'a' + 10;
+		b[i] = hi << 4 | lo;
+	}
+
+	// The kernel is little-endian; the host might not be.
+	rec->tsc = get_le(b + 0, 8);
+	rec->reason = get_le(b + 8, 4);
+	rec->qual = get_le(b + 12, 4);
+	rec->rip = get_le(b + 16, 4);
+	rec->cycles = get_le(b + 20, 4);
+	rec->vm = get_le(b + 24, 2);
+	rec->cpu = get_le(b + 26, 2);
+	rec->seq = get_le(b + 28, 4);
+	return 0;
+}
+
+static void
+read_dump(FILE *f)
+{
+	char line[256];
+	struct vt_trace_rec rec;
+	size_t len;
+	int indump = 0, bad = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		len = strlen(line);
+		while (len > 0 && isspace((unsigned char) line[len - 1]))
+			line[--len] = 0;
+		if (strncmp(line, VT_TRACE_BEGIN, strlen(VT_TRACE_BEGIN)) == 0) {
+			indump = 1;
+			nrecs = 0;
+			continue;
+		}
+		if (strcmp(line, VT_TRACE_END) == 0) {
+			indump = 0;
+			continue;
+		}
+		if (!indump || line[0] != VT_TRACE_LINE)
+			continue;
+		if (len != 1 + 2 * sizeof(rec) || parse_rec(line + 1, &rec) < 0) {
+			bad++;
+			continue;
+		}
+		if (nrecs == maxrecs) {
+			maxrecs = maxrecs ? maxrecs * 2 : 1024;
+			recs = realloc(recs, maxrecs * sizeof(*recs));
+			if (!recs) {
+				fprintf(stderr, "vtdecode: %s\n", strerror(errno));
+				exit(1);
+			}
+		}
+		recs[nrecs++] = rec;
+	}
+	if (bad)
+		fprintf(stderr, "vtdecode: skipped %d malformed records\n", bad);
+}
+
+static int
+stat_cmp(const void *a, const void *b)
+{
+	const struct rstat *x = *(const struct rstat **) a;
+	const struct rstat *y = *(const struct rstat **) b;
+
+	if (x->cycles != y->cycles)
+		return x->cycles < y->cycles ? 1 : -1;
+	return 0;
+}
+
+static void
+summary(int width)
+{
+	static const char shade[] = " .:-=+*#%@";
+	struct rstat stats[NREASON], *order[NREASON];
+	uint64_t t0, t1, total = 0;
+	unsigned long lost = 0, maxb = 0;
+	size_t i;
+	int r, n, b;
+
+	memset(stats, 0, sizeof(stats));
+	for (r = 0; r < NREASON; r++) {
+		stats[r].min = UINT32_MAX;
+		stats[r].buckets = calloc(width, sizeof(unsigned long));
+	}
+
+	t0 = recs[0].tsc;
+	t1 = recs[nrecs - 1].tsc;
+	for (i = 0; i < nrecs; i++) {
+		struct rstat *s = &stats[reason_index(recs[i].reason)];
+
+		s->count++;
+		s->cycles += recs[i].cycles;
+		if (recs[i].cycles < s->min)
+			s->min = recs[i].cycles;
+		if (recs[i].cycles > s->max)
+			s->max = recs[i].cycles;
+		total += recs[i].cycles;
+		b = (double) (recs[i].tsc - t0) * width / (t1 - t0 + 1);
+		if (++s->buckets[b] > maxb)
+			maxb = s->buckets[b];
+		if (i > 0 && recs[i].seq != recs[i - 1].seq + 1)
+			lost += recs[i].seq - recs[i - 1].seq - 1;
+	}
+
+	printf("%lu exits over %llu cycles, %llu cycles in handlers\n",
+	       (unsigned long) nrecs, (unsigned long long) (t1 - t0),
+	       (unsigned long long) total);
+	if (lost)
+		printf("%lu records missing from the dump\n", lost);
+
+	for (n = 0, r = 0; r < NREASON; r++)
+		if (stats[r].count)
+			order[n++] = &stats[r];
+	qsort(order, n, sizeof(order[0]), stat_cmp);
+
+	printf("\n%-22s %9s %6s %14s %6s %9s %9s %9s\n", "reason", "count",
+	       "%exit", "cycles", "%time", "avg", "min", "max");
+	for (i = 0; i < n; i++) {
+		struct rstat *s = order[i];
+
+		printf("%-22s %9lu %6.2f %14llu %6.2f %9llu %9u %9u\n",
+		       reason_str(s - stats), s->count,
+		       100.0 * s->count / nrecs,
+		       (unsigned long long) s->cycles,
+		       total ? 100.0 * s->cycles / total : 0.0,
+		       (unsigned long long) (s->cycles / s->count),
+		       s->min, s->max);
+	}
+
+	printf("\ntimeline, %llu cycles per column\n",
+	       (unsigned long long) ((t1 - t0) / width + 1));
+	for (i = 0; i < n; i++) {
+		struct rstat *s = order[i];
+
+		printf("%-22s |", reason_str(s - stats));
+		for (b = 0; b < width; b++)
+			putchar(shade[s->buckets[b] == 0 ? 0 :
+				      1 + (s->buckets[b] - 1) * (sizeof(shade) - 2) / maxb]);
+		printf("|\n");
+	}
+}
+
+static int
+site_cmp(const void *a, const void *b)
+{
+	const struct vt_trace_rec *x = a, *y = b;
+
+	if (x->vm != y->vm)
+		return x->vm < y->vm ? -1 : 1;
+	if (reason_index(x->reason) != reason_index(y->reason))
+		return reason_index(x->reason) < reason_index(y->reason) ? -1 : 1;
+	if (x->rip != y->rip)
+		return x->rip < y->rip ? -1 : 1;
+	return 0;
+}
+
+// One line per (VM, exit reason, guest RIP), weighted by handler cycles.
+static void
+folded(void)
+{
+	uint64_t sum;
+	size_t i, j;
+
+	qsort(recs, nrecs, sizeof(recs[0]), site_cmp);
+	for (i = 0; i < nrecs; i = j) {
+		sum = 0;
+		for (j = i; j < nrecs && site_cmp(&recs[i], &recs[j]) == 0; j++)
+			sum += recs[j].cycles;
+		printf("vm%u;%s;%#x %llu\n", recs[i].vm,
+		       reason_str(reason_index(recs[i].reason)), recs[i].rip,
+		       (unsigned long long) sum);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILE *f = stdin;
+	int c, fold = 0, width = WIDTH;
+
+	while ((c = getopt(argc, argv, "fw:")) != -1)
+		switch (c) {
+		case 'f':
+			fold = 1;
+			break;
+		case 'w':
+			width = atoi(optarg);
+			if (width < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	if (optind < argc - 1)
+		usage();
+	if (optind == argc - 1 && !(f = fopen(argv[optind], "r"))) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		usage();
+	}
+
+	read_dump(f);
+	if (nrecs == 0) {
+		fprintf(stderr, "vtdecode: no trace records found\n");
+		return 1;
+	}
+	if (fold)
+		folded();
+	else
+		summary(width);
+	return 0;
+}
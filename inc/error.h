@@ -12,7 +12,8 @@
 #define E_NO_FREE_ENV	5	// Attempt to create a new environment beyond
 				// the maximum allowed
 #define E_FAULT		6	// Memory fault
+#define E_NOT_SUPP	7	// Operation not supported by the hardware
 
-#define	MAXERROR	6
+#define	MAXERROR	7
 
 #endif	// !JOS_INC_ERROR_H */
@@ -351,6 +351,23 @@ asm_vmresume_regs (struct vt_vmentry_regs *p)
 #endif
 }
 
+/* 66 0f 38 80 02          invept (%edx),%eax */
+static inline void
+asm_invept (ulong type, void *desc)
+{
+#ifdef AS_DOESNT_SUPPORT_VMX
+	asm volatile (".byte 0x66, 0x0f, 0x38, 0x80, 0x02"
+		      :
+		      : "a" (type), "d" (desc)
+		      : "cc", "memory");
+#else
+	asm volatile ("invept %0,%1"
+		      :
+		      : "m" (*(u64 *)desc), "r" (type)
+		      : "cc", "memory");
+#endif
+}
+
 /* 0f 78 c2                vmread %eax,%edx */
 static inline void
 asm_vmread (ulong index, ulong *val)
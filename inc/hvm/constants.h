@@ -35,6 +35,7 @@
 #define CPUID_1_EBX_NUMOFLP_MASK	0x00FF0000
 #define CPUID_1_EBX_NUMOFLP_1		0x00010000
 #define CPUID_1_ECX_VMX_BIT		0x20
+#define CPUID_1_ECX_HYPERVISOR_BIT	0x80000000
 #define CPUID_1_EDX_PSE_BIT		0x8
 #define CPUID_1_EDX_TSC_BIT		0x10
 #define CPUID_1_EDX_MSR_BIT		0x20
@@ -67,6 +68,7 @@
 #define MSR_IA32_VMX_EXIT_CTLS		0x483
 #define MSR_IA32_VMX_ENTRY_CTLS		0x484
 #define MSR_IA32_VMX_MISC		0x485
+#define MSR_IA32_VMX_MISC_PREEMPT_RATE_MASK	0x1F
 #define MSR_IA32_VMX_CR0_FIXED0		0x486
 #define MSR_IA32_VMX_CR0_FIXED1		0x487
 #define MSR_IA32_VMX_CR4_FIXED0		0x488
@@ -140,6 +142,14 @@
 #define VMCS_VMCS_LINK_POINTER_HIGH	0x2801
 #define VMCS_GUEST_IA32_DEBUGCTL	0x2802
 #define VMCS_GUEST_IA32_DEBUGCTL_HIGH	0x2803
+#define VMCS_GUEST_PDPTE0		0x280A
+#define VMCS_GUEST_PDPTE0_HIGH		0x280B
+#define VMCS_GUEST_PDPTE1		0x280C
+#define VMCS_GUEST_PDPTE1_HIGH		0x280D
+#define VMCS_GUEST_PDPTE2		0x280E
+#define VMCS_GUEST_PDPTE2_HIGH		0x280F
+#define VMCS_GUEST_PDPTE3		0x2810
+#define VMCS_GUEST_PDPTE3_HIGH		0x2811
 
 /* 32-Bit Control Fields */
 #define VMCS_PIN_BASED_VMEXEC_CTL	0x4000
@@ -150,6 +160,7 @@
 #define VMCS_CR3_TARGET_COUNT		0x400A
 #define VMCS_VMEXIT_CTL			0x400C
 #define VMCS_VMEXIT_CTL_HOST_ADDRESS_SPACE_SIZE_BIT 0x200
+#define VMCS_VMEXIT_CTL_SAVE_PREEMPT_TIMER_BIT 0x400000
 #define VMCS_VMEXIT_MSR_STORE_COUNT	0x400E
 #define VMCS_VMEXIT_MSR_LOAD_COUNT	0x4010
 #define VMCS_VMENTRY_CTL		0x4012
@@ -192,6 +203,7 @@
 #define VMCS_GUEST_ACTIVITY_STATE	0x4826
 #define VMCS_GUEST_SMBASE		0x4828
 #define VMCS_GUEST_IA32_SYSENTER_CS	0x482A
+#define VMCS_VMX_PREEMPTION_TIMER_VALUE	0x482E
 
 /* 32-Bit Host-State Field */
 #define VMCS_HOST_IA32_SYSENTER_CS	0x4C00
@@ -257,6 +269,7 @@
 #define VMCS_PIN_BASED_VMEXEC_CTL_EXINTEXIT_BIT	0x1
 #define VMCS_PIN_BASED_VMEXEC_CTL_NMIEXIT_BIT	0x8
 #define VMCS_PIN_BASED_VMEXEC_CTL_VIRTNMIS_BIT	0x20
+#define VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT_TIMER_BIT	0x40
 #define VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT_BIT	0x4
 #define VMCS_PROC_BASED_VMEXEC_CTL_USETSCOFF_BIT	0x8
 #define VMCS_PROC_BASED_VMEXEC_CTL_HLTEXIT_BIT		0x80
@@ -282,6 +295,25 @@
 #define SECONDARY_EXEC_ENABLE_EPT               	0x00000002
 #define SECONDARY_EXEC_UNRESTRICTED_GUEST              	0x00000080
 
+#define EPT_VIOLATION_READ_BIT		0x1
+#define EPT_VIOLATION_WRITE_BIT		0x2
+#define EPT_VIOLATION_FETCH_BIT		0x4
+#define EPT_VIOLATION_GLA_VALID_BIT	0x80
+
+/* Exit qualification of control-register accesses */
+#define EXIT_QUAL_CR_NUM_MASK		0xF
+#define EXIT_QUAL_CR_TYPE_MASK		0x30
+#define EXIT_QUAL_CR_TYPE_MOV_TO_CR	0x00
+#define EXIT_QUAL_CR_GPR_MASK		0xF00
+#define EXIT_QUAL_CR_GPR_SHIFT		8
+#define EXIT_QUAL_IO_SIZE_MASK		0x7
+#define EXIT_QUAL_IO_IN_BIT		0x8
+#define EXIT_QUAL_IO_STRING_BIT		0x10
+#define EXIT_QUAL_IO_PORT_SHIFT		16
+
+#define INVEPT_TYPE_SINGLE_CONTEXT	0x1
+#define INVEPT_TYPE_ALL_CONTEXT		0x2
+
 #define VMCS_GUEST_ACTIVITY_STATE_ACTIVE	0x0
 #define VMCS_GUEST_ACTIVITY_STATE_HLT		0x1
 #define VMCS_GUEST_ACTIVITY_STATE_SHUTDOWN	0x2
@@ -549,6 +581,7 @@
 
 #define CR3_PWT_BIT			0x8
 #define CR3_PCD_BIT			0x10
+#define CR3_PAE_PDPT_MASK		0xFFFFFFE0
 
 #define CR4_VME_BIT			0x1
 #define CR4_PVI_BIT			0x2
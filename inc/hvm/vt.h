@@ -43,5 +43,6 @@
 
 
 void vt_main(void);
+void vt_run_slice(void);
 
 #endif
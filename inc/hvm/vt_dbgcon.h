@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JOS_VT_DBGCON_H
+#define JOS_VT_DBGCON_H
+
+#include <inc/types.h>
+
+/*
+ * Debug console: one emulated MMIO page through which a guest can log
+ * to the host's kernel log without any I/O port of its own.  Every byte
+ * stored anywhere in the page is appended to a line, in address order
+ * within one store; a newline or a full line sends the line to klog,
+ * tagged with the VM id.  Loads from offset 0 return DBGCON_MAGIC, so a
+ * guest can probe for the device; other loads return 0.
+ *
+ * The page sits right above guest RAM, where the EPT never maps
+ * anything the guest could use, so "rep movsb" of a string to
+ * DBGCON_BASE is the whole driver.
+ */
+
+#define DBGCON_BASE	0x1000000		/* VM_MEM_SIZE */
+#define DBGCON_SIZE	0x1000
+#define DBGCON_MAGIC	0x43474244		/* "DBGC" */
+#define DBGCON_LINE	80
+
+struct vt_dbgcon {
+	char line[DBGCON_LINE];
+	int len;
+	u64 nbytes;		/* bytes received, for the record */
+};
+
+int vt_dbgcon_init(void);
+
+#endif
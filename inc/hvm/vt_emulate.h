@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JOS_VT_EMULATE_H
+#define JOS_VT_EMULATE_H
+
+#include <inc/types.h>
+
+/*
+ * Instruction emulation for exits the hardware cannot complete on its own,
+ * such as guest accesses to emulated MMIO regions.  Only the instruction
+ * forms guests commonly use against device memory are decoded:
+ * MOV, MOVS, STOS, CMP, AND, OR and TEST.
+ */
+
+#define VT_INSN_MAXLEN		15
+#define VT_MAX_MMIO		8
+
+/*
+ * Handler of an emulated MMIO region.  'data' points to 'len' (1, 2 or 4)
+ * bytes the guest stores to 'gpa' if 'write' is true; otherwise the
+ * handler fills it with the value the guest loads.
+ */
+typedef void (*vt_mmio_handler_t)(phys_t gpa, bool write, void *data,
+				  uint len, void *arg);
+
+struct vt_mmio_region {
+	phys_t base;
+	ulong len;
+	vt_mmio_handler_t handler;
+	void *arg;
+};
+
+enum vt_insn_op {
+	VT_OP_MOV,
+	VT_OP_MOVS,
+	VT_OP_STOS,
+	VT_OP_CMP,
+	VT_OP_AND,
+	VT_OP_OR,
+	VT_OP_TEST,
+};
+
+enum vt_operand {
+	VT_OPND_NONE,
+	VT_OPND_REG,
+	VT_OPND_MEM,
+	VT_OPND_IMM,
+};
+
+/* Decoded instruction descriptor */
+struct vt_insn {
+	u8 len;			/* total length, prefixes included */
+	u8 op;			/* enum vt_insn_op */
+	u8 dst, src;		/* enum vt_operand */
+	u8 opsize;		/* operand size in bytes: 1, 2 or 4 */
+	u8 adsize;		/* address size in bytes: 2 or 4 */
+	u8 rep;			/* F3 prefix present */
+	u8 seg;			/* segment of the memory operand */
+	u8 reg;			/* register operand */
+	i8 base, index;		/* memory operand registers, -1 if unused */
+	u8 scale;
+	u32 disp;
+	u32 imm;
+};
+
+/* Counters, shown by "matrix list" */
+struct vt_emulate_stats {
+	u64 nemulated;		/* instructions emulated */
+	u64 ndecoded;		/* instructions decoded */
+	u64 ngen_hits;		/* cache hits on a protected code page */
+	u64 ncode_writes;	/* writes to protected code pages */
+	u64 nmixed_pages;	/* code pages left writable for good */
+};
+
+extern struct vt_emulate_stats vt_emulate_stats;
+
+int vt_mmio_register(phys_t base, ulong len, vt_mmio_handler_t handler,
+		     void *arg);
+bool vt_emulate_mmio(phys_t gpa);
+bool vt_emulate_code_write(phys_t gpa);
+void vt_emulate_flush(void);
+int vt_gpa_read(phys_t gpa, void *data, uint len);
+void vt_emulate_tlb_flush(void);
+void vt_emulate_invlpg(ulong gla);
+void vt_emulate_ept_flush(void);
+void vt_emulate_check(void);
+
+#endif
@@ -28,7 +28,7 @@
  */
 
 #ifndef JOS_VT_EPT_H
-#define JOS_vT_EPT_H
+#define JOS_VT_EPT_H
 
 #include <inc/types.h>
 #include <inc/hvm/constants.h>
@@ -67,6 +67,11 @@ typedef union {
 
 #define GFN(addr) (gfn_t)((addr)>>PAGESIZE_SHIFT)
 
+/* avail1 bits */
+#define EPT_AVAIL_COW 0x01 /* write-protected, shared copy-on-write */
+#define EPT_AVAIL_PRIVATE 0x02 /* mfn is a page the VM holds a reference on */
+#define EPT_AVAIL_BALLOON 0x04 /* guest RAM given back to the host, not present */
+
 #define P2M_READABLE 0x01
 #define P2M_WRITABLE 0x02
 #define P2M_EXECUTABLE 0x04
@@ -95,6 +100,12 @@ typedef union {
 
 #define EPT_EACHTABLE_ENTRIES       512
 
-void ept_setup();
+int ept_setup(void);
+ept_entry_t *ept_lookup(ept_control *ept, phys_t gpa, int *level);
+ept_entry_t *ept_walk(phys_t gpa, int *level);
+int ept_gpa2hpa(phys_t gpa, phys_t *hpa);
+void ept_invept(ept_control *ept);
+void ept_invalidate(void);
+void ept_destroy(ept_control *ept);
 
 #endif
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JOS_VT_HYPERCALL_H
+#define JOS_VT_HYPERCALL_H
+
+/*
+ * Hypercall ABI.  The guest executes VMCALL with the call number in EAX
+ * and the arguments in EBX and ECX.  The result comes back in EAX; it
+ * is negative (-E_*) on error.
+ */
+
+/*
+ * Balloon: EBX is the guest physical address of an array of ECX 32-bit
+ * guest frame numbers, which must not cross a page.  INFLATE gives the
+ * frames back to the host; DEFLATE asks for them again, zeroed.  Both
+ * return how many frames they changed.  Touching an inflated frame
+ * deflates it.
+ */
+#define HC_BALLOON_INFLATE	0x1
+#define HC_BALLOON_DEFLATE	0x2
+
+/*
+ * Host monitor: stop running VMs and return to the host's monitor, as
+ * the guest's "host" command does.  The guest resumes after the VMCALL,
+ * with 0 in EAX, on the next "matrix run".
+ */
+#define HC_HOST_MONITOR		0x3
+
+#endif
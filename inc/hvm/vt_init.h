@@ -34,6 +34,10 @@
 #include <inc/types.h>
 
 void vt_init (void);
+int vt_vm_init (void);
+
+extern u32 vt_preempt_rate;
 bool has_vmx(void);
+bool vt_has_unrestricted_guest(void);
 
 #endif
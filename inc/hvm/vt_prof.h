@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JOS_VT_PROF_H
+#define JOS_VT_PROF_H
+
+/*
+ * Hypervisor self-profiler.  The exit path runs with interrupts off and
+ * the guests own the PIC, so there's no timer to sample from; instead,
+ * every hvprof_period'th exit is armed, and on an armed exit each
+ * HVPROF_PROBE() the handler passes records the raw return-address chain
+ * with the TSC.  The time up to the next probe, or to the end of the
+ * exit, is charged to that chain.  Samples are only collected here; the
+ * monitor's hvprof command symbolizes and aggregates them afterwards.
+ */
+
+#define HVPROF_DEPTH	8	/* return addresses kept per sample */
+#define HVPROF_NSAMPLE	1023	/* samples per CPU */
+
+struct hvprof_sample {
+	uint32_t cycles;		/* time charged to this chain */
+	uintptr_t pc[HVPROF_DEPTH];	/* innermost first; 0-terminated */
+};
+
+extern bool hvprof_on;
+extern bool hvprof_armed;
+extern uint32_t hvprof_period;
+
+#define HVPROF_PROBE() \
+	do { if (hvprof_armed) hvprof_sample (); } while (0)
+
+int hvprof_start (uint32_t period);
+void hvprof_stop (void);
+void hvprof_clear (void);
+void hvprof_exit_begin (void);
+void hvprof_exit_end (void);
+void hvprof_sample (void);
+void hvprof_report (void);
+
+#endif
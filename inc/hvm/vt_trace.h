@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JOS_VT_TRACE_H
+#define JOS_VT_TRACE_H
+
+/*
+ * VM exit trace.  When tracing is on, every exit is recorded into a ring
+ * allocated up front, one fixed 32-byte record per exit, which costs a
+ * few VMREADs and two RDTSCs instead of a cprintf.  "vtrace dump" sends
+ * the ring out of the serial port as hex lines between VT_TRACE_BEGIN
+ * and VT_TRACE_END; hvm/vtdecode.c turns such a capture into summaries.
+ *
+ * This header is shared with the host-side decoder, so it includes
+ * nothing: the includer provides uint*_t.
+ */
+
+struct vt_trace_rec {
+	uint64_t tsc;		/* TSC when the handler started */
+	uint32_t reason;	/* VMCS exit reason */
+	uint32_t qual;		/* exit qualification, low 32 bits */
+	uint32_t rip;		/* guest RIP at the exit */
+	uint32_t cycles;	/* TSC ticks spent handling the exit */
+	uint16_t vm;		/* VM id */
+	uint16_t cpu;
+	uint32_t seq;		/* record number, to spot lost records */
+};
+
+#define VT_TRACE_BEGIN	"vtrace: begin"
+#define VT_TRACE_END	"vtrace: end"
+#define VT_TRACE_LINE	'T'	/* record line: 'T' and 64 hex digits */
+
+#ifdef JOS_KERNEL
+
+#define VT_TRACE_ORDER	6	/* ring size: 64 pages, 8192 records */
+
+extern bool vt_trace_on;
+
+int vt_trace_start (void);
+void vt_trace_stop (void);
+void vt_trace_clear (void);
+uint32_t vt_trace_count (void);
+int vt_trace_dump (void);
+struct vt_trace_rec *vt_trace_begin (void);
+void vt_trace_end (struct vt_trace_rec *rec);
+
+#endif /* JOS_KERNEL */
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2012 Shanghai JiaoTong University, School of Software, TC group
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JOS_VT_VM_H
+#define JOS_VT_VM_H
+
+#include <inc/types.h>
+#include <inc/hvm/asm.h>
+#include <inc/hvm/vt_dbgcon.h>
+#include <inc/hvm/vt_ept.h>
+#include <inc/hvm/vt_emulate.h>
+#include <inc/hvm/vt_pic.h>
+#include <inc/hvm/vt_vga.h>
+
+#define NVM		4
+
+/*
+ * Guest RAM: 0 - 0x9FFFF and 1MB up to the VM's memsize, backed by
+ * pages of its own.  The VGA text buffer is private too.
+ */
+#define VM_MEM_SIZE	(16 << 20)
+
+/* Length of a time slice, in TSC ticks */
+#define VM_TIMESLICE	(1 << 24)
+
+enum vm_state {
+	VM_FREE = 0,
+	VM_RUNNABLE,
+	VM_PAUSED,
+	VM_HALTED,
+	VM_STOPPED,
+	VM_SNAPSHOT,			// frozen, only used as a vm_fork() source
+};
+
+struct vm {
+	int id;
+	enum vm_state state;
+	bool launched;			// VMLAUNCH done, use VMRESUME
+	bool preempted;			// time slice used up
+
+	struct Page *vmcs_page;
+	u64 vmcs_pa;			// operand of VMPTRLD/VMCLEAR
+	struct vt_vmentry_regs regs;	// registers not kept in the VMCS
+
+	// Memory map
+	ept_control ept;
+	phys_t memsize;			// top of guest RAM
+	int nballoon;			// pages given back by the balloon
+
+	// Device models
+	struct vt_mmio_region mmio[VT_MAX_MMIO];
+	int nmmio;
+	struct vt_vga vga;
+	struct vt_dbgcon dbgcon;
+	struct vt_pic pic;
+
+	u64 nexits;
+};
+
+extern struct vm *vms[NVM];		// NULL slots are free
+extern struct vm *curvm;		// VM whose VMCS is loaded
+extern struct vm *vm_console;		// VM shown on the host screen
+extern bool vm_escape;			// a guest asked for the host monitor
+
+int vm_create(struct vm **vm_store);
+int vm_fork(struct vm *src, struct vm **vm_store);
+int vm_cow_fault(phys_t gpa);
+struct Page *vm_page(struct vm *vm, phys_t gpa);
+void vm_set_page(struct vm *vm, phys_t gpa, struct Page *pp);
+int vm_balloon(bool inflate, phys_t list, uint count);
+int vm_balloon_fault(phys_t gpa);
+void vm_destroy(struct vm *vm);
+struct vm *vm_lookup(int id);
+void vm_switch(struct vm *vm);
+void vm_sched(void);
+
+#endif
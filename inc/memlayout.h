@@ -34,24 +34,26 @@
  *                     |   Remapped Physical Memory   | RW/--
  *                     |                              | RW/--
  *    KERNBASE ----->  +------------------------------+ 0xf0000000
- *                     |  Cur. Page Table (Kern. RW)  | RW/--  PTSIZE
- *    VPT,KSTACKTOP--> +------------------------------+ 0xefc00000      --+
+ *                     |  Cur. Page Table (Kern. RW)  | RW/--  VPTSIZE
+ *    VPT,KSTACKTOP--> +------------------------------+ 0xef800000      --+
  *                     |         Kernel Stack         | RW/--  KSTKSIZE   |
  *                     | - - - - - - - - - - - - - - -|                 PTSIZE
  *                     |      Invalid Memory (*)      | --/--             |
- *    ULIM     ------> +------------------------------+ 0xef800000      --+
- *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
- *    UVPT      ---->  +------------------------------+ 0xef400000
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |  Temporary Mappings (kmap)   | RW/--  KMAPSIZE   |
+ *    ULIM,KMAPBASE -> +------------------------------+ 0xef600000      --+
+ *                     |  Cur. Page Table (User R-)   | R-/R-  VPTSIZE
+ *    UVPT      ---->  +------------------------------+ 0xeee00000
  *                     |          RO PAGES            | R-/R-  PTSIZE
- *    UPAGES    ---->  +------------------------------+ 0xef000000
+ *    UPAGES    ---->  +------------------------------+ 0xeec00000
  *                     |           RO ENVS            | R-/R-  PTSIZE
- * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
+ * UTOP,UENVS ------>  +------------------------------+ 0xeea00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebff000
+ *                     +------------------------------+ 0xee9ff000
  *                     |       Empty Memory (*)       | --/--  PGSIZE
- *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
+ *    USTACKTOP  --->  +------------------------------+ 0xee9fe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
- *                     +------------------------------+ 0xeebfd000
+ *                     +------------------------------+ 0xee9fd000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -60,14 +62,14 @@
  *                     .                              .
  *                     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
  *                     |     Program Data & Heap      |
- *    UTEXT -------->  +------------------------------+ 0x00800000
+ *    UTEXT -------->  +------------------------------+ 0x00400000
  *    PFTEMP ------->  |       Empty Memory (*)       |        PTSIZE
  *                     |                              |
- *    UTEMP -------->  +------------------------------+ 0x00400000      --+
+ *    UTEMP -------->  +------------------------------+ 0x00200000      --+
  *                     |       Empty Memory (*)       |                   |
  *                     | - - - - - - - - - - - - - - -|                   |
  *                     |  User STAB Data (optional)   |                 PTSIZE
- *    USTABDATA ---->  +------------------------------+ 0x00200000        |
+ *    USTABDATA ---->  +------------------------------+ 0x00100000        |
  *                     |       Empty Memory (*)       |                   |
  *    0 ------------>  +------------------------------+                 --+
  *
@@ -87,22 +89,30 @@
 #define IOPHYSMEM	0x0A0000
 #define EXTPHYSMEM	0x100000
 
-// Virtual page table.  Entry PDX[VPT] in the PD contains a pointer to
-// the page directory itself, thereby turning the PD into a page table,
-// which maps all the PTEs containing the page mappings for the entire
-// virtual address space into that 4 Meg region starting at VPT.
-#define VPT		(KERNBASE - PTSIZE)
+// Virtual page table.  The NPDPENTRIES entries from PDX[VPT] on in the
+// PD point to the page directory pages themselves, thereby turning the
+// PD into page tables, which map all the PTEs containing the page
+// mappings for the entire virtual address space into that 8 Meg region
+// starting at VPT.
+#define VPTSIZE		(NPDPENTRIES * PTSIZE)
+#define VPT		(KERNBASE - VPTSIZE)
 #define KSTACKTOP	VPT
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
 #define ULIM		(KSTACKTOP - PTSIZE) 
 
+// Physical pages above the KERNBASE window are mapped here on demand,
+// see kmap().  The rest of [ULIM, KSTACKTOP-KSTKSIZE) stays unmapped to
+// catch kernel stack overflows.
+#define KMAPBASE	ULIM
+#define KMAPSIZE	(PTSIZE / 2)
+
 /*
  * User read-only mappings! Anything below here til UTOP are readonly to user.
  * They are global pages mapped in at env allocation time.
  */
 
 // Same as VPT but read-only for users
-#define UVPT		(ULIM - PTSIZE)
+#define UVPT		(ULIM - VPTSIZE)
 // Read-only copies of the Page structures
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
@@ -135,9 +145,9 @@
 #ifndef __ASSEMBLER__
 
 /*
- * The page directory entry corresponding to the virtual address range
- * [VPT, VPT + PTSIZE) points to the page directory itself.  Thus, the page
- * directory is treated as a page table as well as a page directory.
+ * The page directory entries corresponding to the virtual address range
+ * [VPT, VPT + VPTSIZE) point to the page directory itself.  Thus, the page
+ * directory is treated as page tables as well as a page directory.
  *
  * One result of treating the page directory as a page table is that all PTEs
  * can be accessed through a "virtual page table" at virtual address VPT (to
@@ -148,8 +158,8 @@
  * will always be available at vpt[VPT >> PGSHIFT], to which vpd is set
  * in entry.S.
  */
-typedef uint32_t pte_t;
-typedef uint32_t pde_t;
+typedef uint64_t pte_t;
+typedef uint64_t pde_t;
 
 extern volatile pte_t vpt[];     // VA of "virtual page table"
 extern volatile pde_t vpd[];     // VA of current page directory
@@ -175,7 +185,15 @@ struct Page {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state, valid while PP_FREE is set: the page
+	// heads a free block of 2^pp_order pages.
+	uint8_t pp_order;
+	uint8_t pp_flags;
 };
 
+#define PP_FREE		0x01	/* heads a block on a free list */
+#define PP_OWNER_SHIFT	4	/* allocated block's owner, see page_stat() */
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
@@ -13,15 +13,19 @@
  *
  */
 
-// A linear address 'la' has a three-part structure as follows:
+// With PAE paging, a linear address 'la' has a four-part structure:
 //
-// +--------10------+-------10-------+---------12----------+
-// | Page Directory |   Page Table   | Offset within Page  |
-// |      Index     |      Index     |                     |
-// +----------------+----------------+---------------------+
-//  \--- PDX(la) --/ \--- PTX(la) --/ \---- PGOFF(la) ----/
+// +-2-+-----9------+------9-------+---------12----------+
+// |PDP|   Page     |  Page Table  | Offset within Page  |
+// | T |  Directory |    Index     |                     |
+// +---+------------+--------------+---------------------+
+//  \----- PDX(la) -/ \- PTX(la) -/ \---- PGOFF(la) ----/
 //  \---------- PGNUM(la) ----------/
 //
+// The four page directories the PDPT points to are kept in four
+// consecutive pages, so that together they form one page directory of
+// NPDENTRIES entries, indexed by the top 11 bits of the address.
+//
 // The PDX, PTX, PGOFF, and PGNUM macros decompose linear addresses as shown.
 // To construct a linear address la from PDX(la), PTX(la), and PGOFF(la),
 // use PGADDR(PDX(la), PTX(la), PGOFF(la)).
@@ -30,26 +34,27 @@
 #define PGNUM(la)	(((uintptr_t) (la)) >> PGSHIFT)
 
 // page directory index
-#define PDX(la)		((((uintptr_t) (la)) >> PTSHIFT) & 0x3FF)
+#define PDX(la)		((((uintptr_t) (la)) >> PTSHIFT) & 0x7FF)
 
 // page table index
-#define PTX(la)		((((uintptr_t) (la)) >> PGSHIFT) & 0x3FF)
+#define PTX(la)		((((uintptr_t) (la)) >> PGSHIFT) & 0x1FF)
 
 // offset in page
 #define PGOFF(la)	(((uintptr_t) (la)) & 0xFFF)
 
 // construct linear address from indexes and offset
-#define PGADDR(d, t, o)	((void*) ((d) << PDXSHIFT | (t) << PGSHIFT | (o)))
+#define PGADDR(d, t, o)	((void*) ((d) << PTSHIFT | (t) << PGSHIFT | (o)))
 
 // Page directory and page table constants.
-#define NPDENTRIES	1024		// page directory entries per page directory
-#define NPTENTRIES	1024		// page table entries per page table
+#define NPDPENTRIES	4		// entries in the page directory pointer table
+#define NPDENTRIES	2048		// page directory entries, all four directories
+#define NPTENTRIES	512		// page table entries per page table
 
 #define PGSIZE		4096		// bytes mapped by a page
 #define PGSHIFT		12		// log2(PGSIZE)
 
 #define PTSIZE		(PGSIZE*NPTENTRIES) // bytes mapped by a page directory entry
-#define PTSHIFT		22		// log2(PTSIZE)
+#define PTSHIFT		21		// log2(PTSIZE)
 
 // Page table/directory entry flags.
 #define PTE_P		0x001	// Present
@@ -72,6 +77,9 @@
 // address in page table entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
+// address in a page directory entry that maps a 2MB page (PTE_PS)
+#define PDE_ADDR_LARGE(pde)	((physaddr_t) (pde) & ~(PTSIZE - 1))
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -87,6 +95,7 @@
 
 #define CR4_PCE		0x00000100	// Performance counter enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
+#define CR4_PAE		0x00000020	// Physical Address Extension
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
 #define CR4_TSD		0x00000004	// Time Stamp Disable
@@ -220,7 +229,7 @@ struct Taskstate {
 	uintptr_t ts_esp2;
 	uint16_t ts_ss2;
 	uint16_t ts_padding3;
-	physaddr_t ts_cr3;	// Page directory base
+	uint32_t ts_cr3;	// Page directory base
 	uintptr_t ts_eip;	// Saved state from last task switch
 	uint32_t ts_eflags;
 	uint32_t ts_eax;	// More saved state (registers)
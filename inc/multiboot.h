@@ -0,0 +1,40 @@
+#ifndef JOS_INC_MULTIBOOT_H
+#define JOS_INC_MULTIBOOT_H
+
+#include <inc/types.h>
+
+// Multiboot (version 0.6.96), as implemented by GRUB.
+// A compliant boot loader enters the kernel with this magic value in
+// %eax and the physical address of a struct multiboot_info in %ebx.
+
+#define MULTIBOOT_BOOTLOADER_MAGIC	0x2BADB002
+
+// multiboot_info flags: which of the fields below are valid
+#define MULTIBOOT_INFO_MEMORY	0x00000001	// mem_lower, mem_upper
+#define MULTIBOOT_INFO_MEM_MAP	0x00000040	// mmap_length, mmap_addr
+
+struct multiboot_info {
+	uint32_t flags;
+	uint32_t mem_lower;	// KB of memory from 0
+	uint32_t mem_upper;	// KB of memory from 1MB, up to the first hole
+	uint32_t boot_device;
+	uint32_t cmdline;
+	uint32_t mods_count;
+	uint32_t mods_addr;
+	uint32_t syms[4];
+	uint32_t mmap_length;	// bytes of memory map at mmap_addr
+	uint32_t mmap_addr;
+};
+
+// One entry of the BIOS e820 memory map.  'size' does not count itself,
+// so the next entry starts 'size + 4' bytes further on.
+struct multiboot_mmap_entry {
+	uint32_t size;
+	uint64_t addr;
+	uint64_t len;
+	uint32_t type;
+} __attribute__((packed));
+
+#define MULTIBOOT_MEMORY_AVAILABLE	1
+
+#endif /* !JOS_INC_MULTIBOOT_H */
@@ -29,6 +29,13 @@
 #define T_SYSCALL   48		// system call
 #define T_DEFAULT   500		// catchall
 
+#define IRQ_OFFSET	32	// IRQ 0 corresponds to int IRQ_OFFSET
+
+// Hardware IRQ numbers. We receive these as (IRQ_OFFSET+IRQ_WHATEVER)
+#define IRQ_KBD		1
+#define IRQ_SERIAL	4
+#define IRQ_SPURIOUS	7
+
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
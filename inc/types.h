@@ -39,13 +39,14 @@ typedef unsigned long int	virt_t;
 typedef unsigned int		phys32_t;
 typedef unsigned long long int	phys_t;
 
-// Pointers and addresses are 32 bits long.
+// Pointers and virtual addresses are 32 bits long; with PAE paging,
+// physical addresses are wider.
 // We use pointer types to represent virtual addresses,
 // uintptr_t to represent the numerical values of virtual addresses,
 // and physaddr_t to represent physical addresses.
 typedef int32_t intptr_t;
 typedef uint32_t uintptr_t;
-typedef uint32_t physaddr_t;
+typedef uint64_t physaddr_t;
 
 // Page numbers are 32 bits long.
 typedef uint32_t ppn_t;
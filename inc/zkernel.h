@@ -0,0 +1,39 @@
+#ifndef JOS_INC_ZKERNEL_H
+#define JOS_INC_ZKERNEL_H
+
+/*
+ * Compressed kernel format, written by boot/mkzkernel.c on the build
+ * host and unpacked by boot/zboot.c before the kernel runs.
+ *
+ * A zkernel is a struct zkernel followed by zk_nseg segments.  Each
+ * segment is a struct zkseg followed by zs_csize bytes of LZ4 block
+ * data (sequences of token, literals, 2-byte offset, no frame header),
+ * padded to a multiple of 4.  Only the ELF load segments are kept,
+ * since those are all the boot loader ever reads of the kernel.
+ *
+ * This header is shared with the host-side compressor, so it includes
+ * nothing: the includer provides uint*_t.
+ */
+
+#define ZKERNEL_MAGIC	0x314B5A4AU	/* "JZK1" in little endian */
+
+struct zkernel {
+	uint32_t zk_magic;	// must equal ZKERNEL_MAGIC
+	uint32_t zk_entry;	// kernel ELF entry point
+	uint32_t zk_nseg;	// number of segments that follow
+	uint32_t zk_size;	// uncompressed bytes, for the record
+};
+
+struct zkseg {
+	uint32_t zs_va;		// load address (masked like boot/main.c)
+	uint32_t zs_filesz;	// bytes produced by decompression
+	uint32_t zs_memsz;	// bytes to clear up to, from zs_va
+	uint32_t zs_csize;	// compressed bytes that follow
+};
+
+#define ZK_MINMATCH	4	// shortest match LZ4 can encode
+#define ZK_LASTLITERALS	5	// the last 5 bytes are always literals
+#define ZK_MFLIMIT	12	// no match may start in the last 12 bytes
+#define ZK_MAXOFFSET	65535
+
+#endif /* !JOS_INC_ZKERNEL_H */
@@ -5,8 +5,12 @@
 #include <inc/kbdreg.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/trap.h>
 
 #include <kern/console.h>
+#include <kern/pmap.h>
+#include <kern/klog.h>
+#include <kern/picirq.h>
 
 
 void cons_intr(int (*proc)(void));
@@ -17,12 +21,19 @@ void cons_intr(int (*proc)(void));
 #define COM1		0x3F8
 
 #define COM_RX		0	// In:	Receive buffer (DLAB=0)
+#define COM_TX		0	// Out: Transmit buffer (DLAB=0)
 #define COM_DLL		0	// Out: Divisor Latch Low (DLAB=1)
 #define COM_DLM		1	// Out: Divisor Latch High (DLAB=1)
 #define COM_IER		1	// Out: Interrupt Enable Register
 #define   COM_IER_RDI	0x01	//   Enable receiver data interrupt
+#define   COM_IER_TXI	0x02	//   Enable transmitter empty interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
+#define   COM_IIR_FIFO	0xC0	//   FIFOs enabled (16550 and later)
 #define COM_FCR		2	// Out: FIFO Control Register
+#define   COM_FCR_ENABLE	0x01	//   Enable the FIFOs
+#define   COM_FCR_RCVR_RESET	0x02	//   Clear the receive FIFO
+#define   COM_FCR_XMIT_RESET	0x04	//   Clear the transmit FIFO
+#define   COM_FCR_TRIGGER_8	0x80	//   Receive interrupt at 8 bytes
 #define COM_LCR		3	// Out: Line Control Register
 #define	  COM_LCR_DLAB	0x80	//   Divisor latch access bit
 #define	  COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
@@ -32,8 +43,26 @@ void cons_intr(int (*proc)(void));
 #define	  COM_MCR_OUT2	0x08	// Out2 complement
 #define COM_LSR		5	// In:	Line Status Register
 #define   COM_LSR_DATA	0x01	//   Data available
+#define   COM_LSR_TXRDY	0x20	//   Transmit buffer empty
+
+#define COM_BAUD	115200
+#define COM_FIFO_SIZE	16	// transmit FIFO of a 16550
 
 static bool serial_exists;
+static int serial_fifo;		// bytes we may write per TX-empty
+
+// Output waits here for the UART, which takes a FIFO's worth at a time
+// whenever its transmitter runs empty.  Only a full ring makes the CPU
+// wait for the line.
+#define SERIAL_TXBUFSIZE	1024
+
+static struct {
+	uint8_t buf[SERIAL_TXBUFSIZE];
+	uint32_t rpos;		// next byte for the UART
+	uint32_t wpos;		// next free slot
+	bool txi;		// TX-empty interrupt enabled
+	bool txi_off;		// a guest owns the PIC: don't enable it
+} serial_tx;
 
 int
 serial_proc_data(void)
@@ -43,38 +72,131 @@ serial_proc_data(void)
 	return inb(COM1+COM_RX);
 }
 
+// If the transmitter is empty, refill it from the TX ring.
+// Called with interrupts off.
+static void
+serial_tx_push(void)
+{
+	int i;
+	bool more;
+
+	if (!(inb(COM1+COM_LSR) & COM_LSR_TXRDY))
+		return;
+	for (i = 0; i < serial_fifo && serial_tx.rpos != serial_tx.wpos; i++)
+		outb(COM1+COM_TX, serial_tx.buf[serial_tx.rpos++ % SERIAL_TXBUFSIZE]);
+
+	// Ask for an interrupt when it's empty again only if there is
+	// more to send, and the IRQ would come to us.
+	more = serial_tx.rpos != serial_tx.wpos && !serial_tx.txi_off;
+	if (more != serial_tx.txi) {
+		serial_tx.txi = more;
+		outb(COM1+COM_IER, COM_IER_RDI | (more ? COM_IER_TXI : 0));
+	}
+}
+
+static void
+serial_tx_kick(void)
+{
+	uint32_t eflags;
+
+	eflags = read_eflags();
+	asm volatile("cli");
+	serial_tx_push();
+	write_eflags(eflags);
+}
+
+// Queue c for the serial line, waiting only if the ring is full.
+static void
+serial_putc(int c)
+{
+	if (!serial_exists)
+		return;
+	while (serial_tx.wpos - serial_tx.rpos == SERIAL_TXBUFSIZE)
+		serial_tx_kick();
+	serial_tx.buf[serial_tx.wpos++ % SERIAL_TXBUFSIZE] = c;
+}
+
+// While a guest owns the PIC, IRQ 4 goes to the guest, so the kernel
+// can't use the TX-empty interrupt.  pic_guest() turns it off; output
+// then goes out as later writes kick the ring.  pic_host() turns it
+// back on, which sends whatever is left.
+void
+serial_txi_allow(bool allow)
+{
+	uint32_t eflags;
+
+	if (!serial_exists)
+		return;
+	eflags = read_eflags();
+	asm volatile("cli");
+	serial_tx.txi_off = !allow;
+	if (!allow && serial_tx.txi) {
+		serial_tx.txi = false;
+		outb(COM1+COM_IER, COM_IER_RDI);
+	}
+	serial_tx_push();
+	write_eflags(eflags);
+}
+
+bool
+serial_present(void)
+{
+	return serial_exists;
+}
+
+// Send n raw bytes out of the serial port only, bypassing the screen.
+// For bulk data such as trace dumps.
+void
+serial_write(const char *buf, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		serial_putc(buf[i]);
+	serial_tx_kick();
+}
+
 void
 serial_intr(void)
 {
-	if (serial_exists)
-		cons_intr(serial_proc_data);
+	if (!serial_exists)
+		return;
+	cons_intr(serial_proc_data);
+	serial_tx_kick();
 }
 
 void
 serial_init(void)
 {
-	// Turn off the FIFO
-	outb(COM1+COM_FCR, 0);
-	
+	// Turn on and clear the FIFOs
+	outb(COM1+COM_FCR, COM_FCR_ENABLE | COM_FCR_RCVR_RESET |
+	     COM_FCR_XMIT_RESET | COM_FCR_TRIGGER_8);
+
 	// Set speed; requires DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_DLAB);
-	outb(COM1+COM_DLL, (uint8_t) (115200 / 9600));
+	outb(COM1+COM_DLL, (uint8_t) (115200 / COM_BAUD));
 	outb(COM1+COM_DLM, 0);
 
 	// 8 data bits, 1 stop bit, parity off; turn off DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_WLEN8 & ~COM_LCR_DLAB);
 
-	// No modem controls
-	outb(COM1+COM_MCR, 0);
+	// DTR and RTS up; OUT2 connects the UART's interrupt line to the
+	// PIC on PCs, and without it IRQ 4 never fires
+	outb(COM1+COM_MCR, COM_MCR_DTR | COM_MCR_RTS | COM_MCR_OUT2);
 	// Enable rcv interrupts
 	outb(COM1+COM_IER, COM_IER_RDI);
 
 	// Clear any preexisting overrun indications and interrupts
 	// Serial port doesn't exist if COM_LSR returns 0xFF
 	serial_exists = (inb(COM1+COM_LSR) != 0xFF);
-	(void) inb(COM1+COM_IIR);
+	// An 8250 or 16450 has no FIFO and takes one byte at a time
+	serial_fifo = (inb(COM1+COM_IIR) & COM_IIR_FIFO) == COM_IIR_FIFO ?
+		COM_FIFO_SIZE : 1;
 	(void) inb(COM1+COM_RX);
 
+	// Enable serial interrupts
+	if (serial_exists)
+		irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_SERIAL));
 }
 
 
@@ -144,9 +266,46 @@ cga_init(void)
 
 
 
-void
-cga_putc(int c)
+// Scroll the screen up a line once output has run off the bottom.
+static void
+cga_scroll(void)
 {
+	int i;
+
+	if (crt_pos < CRT_SIZE)
+		return;
+	memcpy(crt_buf, crt_buf + CRT_COLS, (CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
+	for (i = CRT_SIZE - CRT_COLS; i < CRT_SIZE; i++)
+		crt_buf[i] = 0x0700 | ' ';
+	crt_pos -= CRT_COLS;
+}
+
+// Move the hardware cursor to crt_pos.  Four port writes, which are
+// slow on real hardware and exits when we run nested, so callers that
+// write a lot do it once at the end.
+static void
+cga_cursor(void)
+{
+	/* move that little blinky thing */
+	outb(addr_6845, 14);
+	outb(addr_6845 + 1, crt_pos >> 8);
+	outb(addr_6845, 15);
+	outb(addr_6845 + 1, crt_pos);
+}
+
+static bool
+cga_isctl(int c)
+{
+	c &= 0xff;
+	return c == '\b' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// Put c in the text buffer without moving the cursor.
+static void
+cga_putch(int c)
+{
+	int i;
+
 	// if no attribute given, then use black on white
 	if (!(c & ~0xFF))
 		c |= 0x0700;
@@ -165,32 +324,65 @@ cga_putc(int c)
 		crt_pos -= (crt_pos % CRT_COLS);
 		break;
 	case '\t':
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
+		// Five spaces; the screen may fill up between any two.
+		for (i = 0; i < 5; i++) {
+			crt_buf[crt_pos++] = (c & ~0xff) | ' ';
+			cga_scroll();
+		}
 		break;
 	default:
 		crt_buf[crt_pos++] = c;		/* write the character */
 		break;
 	}
 
-	// What is the purpose of this?
-	if (crt_pos >= CRT_SIZE) {
-		int i;
-		
-		memcpy(crt_buf, crt_buf + CRT_COLS, (CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
-		for (i = CRT_SIZE - CRT_COLS; i < CRT_SIZE; i++)
-			crt_buf[i] = 0x0700 | ' ';
-		crt_pos -= CRT_COLS;
+	cga_scroll();
+}
+
+void
+cga_putc(int c)
+{
+	cga_putch(c);
+	cga_cursor();
+}
+
+// Write n characters, storing runs of plain characters straight into
+// the text buffer and moving the cursor only once at the end.
+static void
+cga_puts(const char *s, int n)
+{
+	int i, m;
+
+	while (n > 0) {
+		m = MIN(n, CRT_SIZE - crt_pos);
+		for (i = 0; i < m && !cga_isctl(s[i]); i++)
+			crt_buf[crt_pos + i] = 0x0700 | (uint8_t) s[i];
+		crt_pos += i;
+		s += i;
+		n -= i;
+		if (n > 0 && cga_isctl(*s)) {
+			cga_putch((uint8_t) *s);
+			s++;
+			n--;
+		}
+		cga_scroll();
 	}
+	cga_cursor();
+}
 
-	/* move that little blinky thing */
-	outb(addr_6845, 14);
-	outb(addr_6845 + 1, crt_pos >> 8);
-	outb(addr_6845, 15);
-	outb(addr_6845 + 1, crt_pos);
+// Copy n cells starting at pos out of / into the text buffer, including
+// the pages past the screen.  Neither moves the cursor.
+void
+cga_read(unsigned pos, uint16_t *cells, unsigned n)
+{
+	assert(pos + n <= CRT_BUF_SIZE);
+	memcpy(cells, crt_buf + pos, n * sizeof(uint16_t));
+}
+
+void
+cga_write(unsigned pos, const uint16_t *cells, unsigned n)
+{
+	assert(pos + n <= CRT_BUF_SIZE);
+	memcpy(crt_buf + pos, cells, n * sizeof(uint16_t));
 }
 
 
@@ -354,6 +546,9 @@ kbd_intr(void)
 void
 kbd_init(void)
 {
+	// Drain the KBD buffer so that QEMU generates interrupts.
+	kbd_intr();
+	irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_KBD));
 }
 
 
@@ -414,9 +609,23 @@ void
 cons_putc(int c)
 {
 	//lpt_putc(c);
+	serial_putc(c);
+	serial_tx_kick();
 	cga_putc(c);
 }
 
+// output n characters to the console
+void
+cons_write(const char *buf, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		serial_putc(buf[i]);
+	serial_tx_kick();
+	cga_puts(buf, n);
+}
+
 // initialize the console devices
 void
 cons_init(void)
@@ -443,8 +652,18 @@ getchar(void)
 {
 	int c;
 
-	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+	// Drain the kernel log and zero free pages while waiting for
+	// input, then sleep until the keyboard or serial line interrupts.
+	// sti only takes effect after the next instruction, so an IRQ can't
+	// slip in between the last check and the hlt.
+	pic_host();
+	while (1) {
+		asm volatile("cli");
+		if ((c = cons_getc()) != 0)
+			break;
+		if (!klog_drain() && !page_zero_idle())
+			asm volatile("sti; hlt");
+	}
 	return c;
 }
 
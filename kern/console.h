@@ -16,13 +16,21 @@
 #define CRT_ROWS	25
 #define CRT_COLS	80
 #define CRT_SIZE	(CRT_ROWS * CRT_COLS)
+#define CRT_BUF_SIZE	0x4000		// cells in the whole 32K text buffer
 
 void cons_init(void);
 void cons_putc(int c);
+void cons_write(const char *buf, int n);
 int cons_getc(void);
 
+void cga_read(unsigned pos, uint16_t *cells, unsigned n);
+void cga_write(unsigned pos, const uint16_t *cells, unsigned n);
+
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
+bool serial_present(void);
+void serial_txi_allow(bool allow);
+void serial_write(const char *buf, int n);
 
 void get_cursor_loc(void);
 #endif /* _CONSOLE_H_ */
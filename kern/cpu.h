@@ -0,0 +1,21 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+// Maximum number of CPUs
+#define NCPU	8
+
+// The current CPU's number.  Only the boot CPU runs the kernel for now;
+// per-CPU data is indexed by this so that it stays correct once the
+// other CPUs are started.
+static inline int
+cpunum(void)
+{
+	return 0;
+}
+
+#endif	// !JOS_KERN_CPU_H
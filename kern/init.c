@@ -7,8 +7,12 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/kdebug.h>
+#include <kern/klog.h>
 #include <kern/kclock.h>
 #include <kern/trap.h>
+#include <kern/picirq.h>
 
 #include <inc/hvm/vt_init.h>
 
@@ -18,6 +22,10 @@ i386_init(void)
 	extern char edata[], end[];
 	uint32_t *ctorva;
 
+	// Pick the string routines for this CPU before anything uses them.
+	string_init();
+	klog_init();
+
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
@@ -28,10 +36,15 @@ i386_init(void)
 	boot_mem_init();
 	page_init();
 	page_check();
+	kmem_init();
+	debuginfo_init();
 
 	// Lab 2 interrupt and gate descriptor initialization functions
 	idt_init();
 
+	// Lab 4 multitasking initialization functions
+	pic_init();
+
 	// Test IDT (lab 2 only)
 	//__asm__ __volatile__("int3");
 	//cprintf("Breakpoint succeeded!\n");
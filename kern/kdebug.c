@@ -2,14 +2,31 @@
 #include <inc/string.h>
 #include <inc/memlayout.h>
 #include <inc/assert.h>
+#include <inc/stdio.h>
 
 #include <kern/kdebug.h>
+#include <kern/pmap.h>
 
 extern const struct Stab __STAB_BEGIN__[];	// Beginning of stabs table
 extern const struct Stab __STAB_END__[];	// End of stabs table
 extern const char __STABSTR_BEGIN__[];		// Beginning of string table
 extern const char __STABSTR_END__[];		// End of string table
 
+// Sorted address indexes over the kernel's function and line stabs,
+// built once by debuginfo_init(), so that a lookup is one binary search
+// per table instead of stab_binsearch()'s scans.  debuginfo_eip() falls
+// back to searching the stabs directly if they couldn't be built.
+struct stab_index {
+	uintptr_t addr;		// first address the stab covers
+	uintptr_t end;		// functions: address just past the end
+	int stab;		// the N_FUN or N_SLINE stab
+	int aux;		// functions: number of arguments;
+				// lines: the N_SO or N_SOL stab naming the file
+};
+
+static struct stab_index *fun_index, *line_index;
+static int nfun, nline;
+
 
 // stab_binsearch(stabs, region_left, region_right, type, addr)
 //
@@ -94,6 +111,178 @@ stab_binsearch(const struct Stab *stabs, int *region_left, int *region_right,
 }
 
 
+static bool
+index_less(const struct stab_index *a, const struct stab_index *b)
+{
+	return a->addr < b->addr || (a->addr == b->addr && a->stab < b->stab);
+}
+
+static void
+index_sift(struct stab_index *idx, int i, int n)
+{
+	struct stab_index t;
+	int c;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && index_less(&idx[c], &idx[c + 1]))
+			c++;
+		if (!index_less(&idx[i], &idx[c]))
+			break;
+		t = idx[i];
+		idx[i] = idx[c];
+		idx[c] = t;
+	}
+}
+
+// Heapsort idx by address.  Equal addresses keep stab order, so that a
+// search finds the last stab at an address, as stab_binsearch does.
+static void
+index_sort(struct stab_index *idx, int n)
+{
+	struct stab_index t;
+	int i;
+
+	for (i = n / 2 - 1; i >= 0; i--)
+		index_sift(idx, i, n);
+	for (i = n - 1; i > 0; i--) {
+		t = idx[0];
+		idx[0] = idx[i];
+		idx[i] = t;
+		index_sift(idx, 0, i);
+	}
+}
+
+// Return the last entry of idx[0..n) whose address is <= addr, or -1.
+static int
+index_search(const struct stab_index *idx, int n, uintptr_t addr)
+{
+	int l = 0, r = n, m;
+
+	while (l < r) {
+		m = (l + r) / 2;
+		if (idx[m].addr <= addr)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l - 1;
+}
+
+// Build the function and line indexes.  Call once the page allocator
+// is up.
+void
+debuginfo_init(void)
+{
+	const struct Stab *stabs = __STAB_BEGIN__, *s;
+	const char *stabstr = __STABSTR_BEGIN__;
+	int nstabs = __STAB_END__ - __STAB_BEGIN__;
+	size_t nstr = __STABSTR_END__ - __STABSTR_BEGIN__;
+	struct stab_index *fn, *fi, *li;
+	struct Page *pp;
+	int i, file, order;
+	size_t nf, nl;
+
+	// N_FUN stabs with an empty name mark the end of a function and
+	// hold its size.
+#define FUN_END(s)	((s)->n_strx >= nstr || stabstr[(s)->n_strx] == 0)
+
+	nf = nl = 0;
+	for (s = stabs; s < stabs + nstabs; s++)
+		if (s->n_type == N_FUN && !FUN_END(s))
+			nf++;
+		else if (s->n_type == N_SLINE)
+			nl++;
+	for (order = 0; (PGSIZE << order) < (nf + nl) * sizeof(*fi); order++)
+		/* do nothing */;
+	if (order > PAGE_MAX_ORDER ||
+	    page_alloc_order(&pp, order, PAGE_OWNER(PGO_KERNEL)) < 0) {
+		cprintf("debuginfo: no memory for the symbol index\n");
+		return;
+	}
+	fi = page2kva(pp);
+	li = fi + nf;
+
+	// Line stabs inside a function hold the offset from its start.
+	nfun = nline = 0;
+	fn = NULL;
+	file = 0;
+	for (i = 0; i < nstabs; i++) {
+		s = &stabs[i];
+		switch (s->n_type) {
+		case N_SO:
+			fn = NULL;
+			if (s->n_value)
+				file = i;
+			break;
+		case N_SOL:
+			file = i;
+			break;
+		case N_FUN:
+			if (FUN_END(s)) {
+				if (fn)
+					fn->end = fn->addr + s->n_value;
+				fn = NULL;
+				break;
+			}
+			fn = &fi[nfun++];
+			fn->addr = s->n_value;
+			fn->end = 0;
+			fn->stab = i;
+			for (fn->aux = 0; i + fn->aux + 1 < nstabs &&
+			     stabs[i + fn->aux + 1].n_type == N_PSYM; fn->aux++)
+				/* do nothing */;
+			break;
+		case N_SLINE:
+			li[nline].addr = s->n_value + (fn ? fn->addr : 0);
+			li[nline].stab = i;
+			li[nline].aux = file;
+			nline++;
+			break;
+		}
+	}
+#undef FUN_END
+
+	index_sort(fi, nfun);
+	index_sort(li, nline);
+	// A function without an end marker runs up to the next one.
+	for (i = 0; i < nfun; i++)
+		if (fi[i].end == 0)
+			fi[i].end = i + 1 < nfun ? fi[i + 1].addr : ~0;
+	fun_index = fi;
+	line_index = li;
+}
+
+// debuginfo_eip() using the indexes.
+static int
+debuginfo_index(uintptr_t addr, struct Eipdebuginfo *info,
+		const struct Stab *stabs, const char *stabstr,
+		const char *stabstr_end)
+{
+	const struct stab_index *fn = NULL, *ln;
+	int i;
+
+	i = index_search(fun_index, nfun, addr);
+	if (i >= 0 && addr < fun_index[i].end) {
+		fn = &fun_index[i];
+		if (stabs[fn->stab].n_strx < stabstr_end - stabstr)
+			info->eip_fn_name = stabstr + stabs[fn->stab].n_strx;
+		info->eip_fn_addr = fn->addr;
+		info->eip_fn_narg = fn->aux;
+	}
+	// Ignore stuff after the colon.
+	info->eip_fn_namelen = strfind(info->eip_fn_name, ':') - info->eip_fn_name;
+
+	i = index_search(line_index, nline, addr);
+	if (i < 0 || (fn && line_index[i].addr < fn->addr))
+		return -1;
+	ln = &line_index[i];
+	info->eip_line = stabs[ln->stab].n_desc;
+	if (ln->aux > 0 && stabs[ln->aux].n_strx < stabstr_end - stabstr)
+		info->eip_file = stabstr + stabs[ln->aux].n_strx;
+	return 0;
+}
+
+
 // debuginfo_eip(addr, info)
 //
 //	Fill in the 'info' structure with information about the specified
@@ -131,6 +320,9 @@ debuginfo_eip(uintptr_t addr, struct Eipdebuginfo *info)
 	if (stabstr_end <= stabstr || stabstr_end[-1] != 0)
 		return -1;
 
+	if (fun_index != NULL)
+		return debuginfo_index(addr, info, stabs, stabstr, stabstr_end);
+
 	// Now we find the right stabs that define the function containing
 	// 'eip'.  First, we find the basic source file containing 'eip'.
 	// Then, we look in that source file for the function.  Then we look
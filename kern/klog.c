@@ -0,0 +1,143 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/error.h>
+
+#include <kern/klog.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Each CPU's ring has one producer, the CPU itself, with interrupts off
+// while it writes.  Readers never block it: they copy a record and then
+// check that the producer hadn't come round to that slot again.
+struct klog_ring {
+	volatile uint32_t head;		// index of the next record to write
+	uint32_t tail;			// next record for klog_drain()
+	struct klog_rec recs[KLOG_NREC];
+} __attribute__((aligned(64)));
+
+static struct klog_ring klog_rings[NCPU];
+static struct spinlock klog_lock;	// serializes klog_drain()
+
+// Records printed by one klog_drain() call, so that a burst of logging
+// doesn't keep the idle loop from noticing input.
+#define KLOG_DRAIN_MAX	16
+
+void
+klog_init(void)
+{
+	spin_initlock(&klog_lock);
+}
+
+void
+vklog(const char *fmt, va_list ap)
+{
+	struct klog_ring *r;
+	struct klog_rec *rec;
+	uint32_t eflags;
+	int n;
+
+	eflags = read_eflags();
+	asm volatile("cli");
+
+	r = &klog_rings[cpunum()];
+	rec = &r->recs[r->head % KLOG_NREC];
+	rec->tsc = read_tsc();
+	rec->seq = r->head;
+	n = vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+	if (n > 0 && n < sizeof(rec->msg) && rec->msg[n - 1] == '\n')
+		rec->msg[n - 1] = '\0';
+
+	// Publish the record only once it is complete.
+	asm volatile("" ::: "memory");
+	r->head++;
+
+	write_eflags(eflags);
+}
+
+void
+klog(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vklog(fmt, ap);
+	va_end(ap);
+}
+
+// Copy record i of r into *rec.  Returns 0 on success, or -E_INVAL if
+// the producer has overwritten the record.  The oldest of the last
+// KLOG_NREC records shares its slot with the one being written, so only
+// the last KLOG_NREC - 1 can be read.
+static int
+klog_read(struct klog_ring *r, uint32_t i, struct klog_rec *rec)
+{
+	*rec = r->recs[i % KLOG_NREC];
+	asm volatile("" ::: "memory");
+	if (rec->seq != i || r->head - i > KLOG_NREC - 1)
+		return -E_INVAL;
+	return 0;
+}
+
+static void
+klog_print(int cpu, const struct klog_rec *rec)
+{
+	cprintf("[%08x%08x] cpu%d %s\n", (uint32_t) (rec->tsc >> 32),
+		(uint32_t) rec->tsc, cpu, rec->msg);
+}
+
+// Print some of the records logged since the last call.
+// Returns 1 if it printed anything, else 0.
+int
+klog_drain(void)
+{
+	struct klog_ring *r;
+	struct klog_rec rec;
+	uint32_t head, lost;
+	int cpu, n;
+
+	n = 0;
+	spin_lock(&klog_lock);
+	for (cpu = 0; cpu < NCPU && n < KLOG_DRAIN_MAX; cpu++) {
+		r = &klog_rings[cpu];
+		head = r->head;
+		lost = 0;
+		while (r->tail != head && n < KLOG_DRAIN_MAX) {
+			if (head - r->tail > KLOG_NREC - 1) {
+				lost += head - r->tail - (KLOG_NREC - 1);
+				r->tail = head - (KLOG_NREC - 1);
+			}
+			if (klog_read(r, r->tail, &rec) < 0)
+				lost++;
+			else
+				klog_print(cpu, &rec);
+			r->tail++;
+			n++;
+		}
+		if (lost)
+			cprintf("klog: cpu%d lost %u messages\n", cpu, lost);
+	}
+	spin_unlock(&klog_lock);
+	return n > 0;
+}
+
+// Print every record still in the rings, oldest first, whether or not
+// it has been drained already.
+void
+klog_dump(void)
+{
+	struct klog_ring *r;
+	struct klog_rec rec;
+	uint32_t head, i;
+	int cpu;
+
+	for (cpu = 0; cpu < NCPU; cpu++) {
+		r = &klog_rings[cpu];
+		head = r->head;
+		i = head > KLOG_NREC - 1 ? head - (KLOG_NREC - 1) : 0;
+		for (; i != head; i++)
+			if (klog_read(r, i, &rec) == 0)
+				klog_print(cpu, &rec);
+	}
+}
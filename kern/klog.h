@@ -0,0 +1,34 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KLOG_H
+#define JOS_KERN_KLOG_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/stdarg.h>
+
+// In-memory kernel log.  klog() formats its message into a ring owned
+// by the calling CPU and never touches the console or takes a lock, so
+// it is cheap enough to leave in VM-exit handlers.  klog_drain() copies
+// new records to the console when the CPU has nothing better to do, and
+// the monitor's dmesg command shows whatever the rings still hold.
+// A full ring overwrites its oldest records.
+
+#define KLOG_MSGLEN	52	// makes a record 64 bytes
+#define KLOG_NREC	256	// records per CPU; must be a power of 2
+
+struct klog_rec {
+	uint64_t tsc;			// when it was logged
+	uint32_t seq;			// ring index it was written at
+	char msg[KLOG_MSGLEN];		// without the trailing newline
+};
+
+void klog_init(void);
+void klog(const char *fmt, ...);
+void vklog(const char *fmt, va_list ap);
+int klog_drain(void);
+void klog_dump(void);
+
+#endif	// !JOS_KERN_KLOG_H
@@ -0,0 +1,329 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/stdio.h>
+
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+
+// A slab is a size-aligned block of 2^order pages.  It starts with
+// this header, then 'color' bytes of padding, then the objects.
+// Free objects are chained through a pointer at cache->freeoff: the first
+// word of the object, or a word past its end if the cache has a
+// constructor, so that constructed state survives a free.
+struct kmem_slab {
+	LIST_ENTRY(kmem_slab) link;
+	struct kmem_cache *cache;
+	void *free;			// first free object
+	int inuse;			// objects handed out
+};
+
+// Slabs kept around per cache once they become empty
+#define KMEM_EMPTY_MAX	1
+
+// The cache for struct kmem_cache itself, and the list of all caches
+static struct kmem_cache kmem_cache_cache;
+static LIST_HEAD(, kmem_cache) kmem_caches;
+static struct spinlock kmem_lock;
+
+static void kmem_check(void);
+
+#define FREEPTR(cp, obj)	(*(void **) ((char *) (obj) + (cp)->freeoff))
+
+static void
+kmem_cache_setup(struct kmem_cache *cp, const char *name, size_t size,
+		 size_t align, void (*ctor)(void *))
+{
+	size_t hdr, space;
+
+	memset(cp, 0, sizeof(*cp));
+	strlcpy(cp->name, name, sizeof(cp->name));
+	cp->objsize = size;
+	cp->align = align;
+	cp->ctor = ctor;
+	cp->freeoff = ctor ? ROUNDUP(size, sizeof(void *)) : 0;
+	cp->chunk = ROUNDUP(MAX(cp->freeoff + sizeof(void *), size), align);
+
+	// Pick the smallest slab that holds KMEM_MIN_OBJS objects,
+	// or as many as fit in the largest one.
+	hdr = ROUNDUP(sizeof(struct kmem_slab), align);
+	for (cp->order = 0; ; cp->order++) {
+		space = (PGSIZE << cp->order) - hdr;
+		cp->nobjs = space / cp->chunk;
+		if (cp->nobjs >= KMEM_MIN_OBJS || cp->order == KMEM_MAX_ORDER)
+			break;
+	}
+
+	// Spread the leftover space over successive slabs, a cache line
+	// at a time, so that the first objects of different slabs do not
+	// all compete for the same cache sets.  Steps stay multiples of
+	// the alignment, so that colored objects are still aligned.
+	cp->color_step = MAX(CACHELINE, align);
+	cp->color_max = ROUNDDOWN(space - cp->nobjs * cp->chunk,
+				  cp->color_step);
+	cp->color = 0;
+
+	spin_initlock(&cp->lock);
+	LIST_INIT(&cp->partial);
+	LIST_INIT(&cp->full);
+	LIST_INIT(&cp->empty);
+}
+
+// Initialize the slab allocator and check that it works.
+// Call after page_init().
+void
+kmem_init(void)
+{
+	spin_initlock(&kmem_lock);
+	LIST_INIT(&kmem_caches);
+	kmem_cache_setup(&kmem_cache_cache, "kmem_cache",
+			 sizeof(struct kmem_cache), CACHELINE, NULL);
+	LIST_INSERT_HEAD(&kmem_caches, &kmem_cache_cache, link);
+
+	kmem_check();
+}
+
+//
+// Create a cache of 'size'-byte objects aligned to 'align' bytes,
+// which must be a power of 2 (0 means pointer-aligned).
+// If 'ctor' is given it is called on each object when its slab is
+// allocated; objects must be freed back in their constructed state.
+// Returns NULL if the objects do not fit in a slab or on memory
+// exhaustion.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *))
+{
+	struct kmem_cache *cp;
+
+	if (align == 0)
+		align = sizeof(void *);
+	assert((align & (align - 1)) == 0);
+	if (size == 0 || size > (PGSIZE << KMEM_MAX_ORDER) / 2)
+		return NULL;
+
+	if ((cp = kmem_cache_alloc(&kmem_cache_cache)) == NULL)
+		return NULL;
+	kmem_cache_setup(cp, name, size, align, ctor);
+
+	spin_lock(&kmem_lock);
+	LIST_INSERT_HEAD(&kmem_caches, cp, link);
+	spin_unlock(&kmem_lock);
+	return cp;
+}
+
+// Give an unlinked, unused slab back to the page allocator.
+static void
+kmem_slab_release(struct kmem_cache *cp, struct kmem_slab *sp)
+{
+	cp->nslabs--;
+	page_free_order(pa2page(PADDR(sp)), cp->order);
+}
+
+// Destroy a cache.  All its objects must have been freed.
+void
+kmem_cache_destroy(struct kmem_cache *cp)
+{
+	struct kmem_slab *sp;
+
+	assert(cp != &kmem_cache_cache);
+	if (cp->nalloc != 0)
+		panic("kmem_cache_destroy: %s has %u objects in use",
+		      cp->name, cp->nalloc);
+
+	while ((sp = LIST_FIRST(&cp->empty)) != NULL) {
+		LIST_REMOVE(sp, link);
+		kmem_slab_release(cp, sp);
+	}
+
+	spin_lock(&kmem_lock);
+	LIST_REMOVE(cp, link);
+	spin_unlock(&kmem_lock);
+	kmem_cache_free(&kmem_cache_cache, cp);
+}
+
+// Allocate a new slab for 'cp' and put it on the empty list.
+// Called with cp->lock held.
+static int
+kmem_slab_grow(struct kmem_cache *cp)
+{
+	struct kmem_slab *sp;
+	struct Page *pp;
+	char *obj;
+	int i, r;
+
+	if ((r = page_alloc_order(&pp, cp->order, 0)) < 0)
+		return r;
+
+	sp = page2kva(pp);
+	sp->cache = cp;
+	sp->inuse = 0;
+	sp->free = NULL;
+
+	obj = (char *) sp + ROUNDUP(sizeof(*sp), cp->align) + cp->color;
+	cp->color += cp->color_step;
+	if (cp->color > cp->color_max)
+		cp->color = 0;
+
+	// Chain the objects in address order.
+	obj += (cp->nobjs - 1) * cp->chunk;
+	for (i = 0; i < cp->nobjs; i++, obj -= cp->chunk) {
+		if (cp->ctor)
+			cp->ctor(obj);
+		FREEPTR(cp, obj) = sp->free;
+		sp->free = obj;
+	}
+
+	LIST_INSERT_HEAD(&cp->empty, sp, link);
+	cp->nempty++;
+	cp->nslabs++;
+	return 0;
+}
+
+//
+// Allocate an object from 'cp'.
+// Returns NULL on memory exhaustion.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *cp)
+{
+	struct kmem_slab *sp;
+	void *obj;
+
+	spin_lock(&cp->lock);
+	if ((sp = LIST_FIRST(&cp->partial)) == NULL) {
+		if (LIST_EMPTY(&cp->empty) && kmem_slab_grow(cp) < 0) {
+			spin_unlock(&cp->lock);
+			return NULL;
+		}
+		sp = LIST_FIRST(&cp->empty);
+		LIST_REMOVE(sp, link);
+		LIST_INSERT_HEAD(&cp->partial, sp, link);
+		cp->nempty--;
+	}
+
+	obj = sp->free;
+	sp->free = FREEPTR(cp, obj);
+	if (++sp->inuse == cp->nobjs) {
+		LIST_REMOVE(sp, link);
+		LIST_INSERT_HEAD(&cp->full, sp, link);
+	}
+	cp->nalloc++;
+	spin_unlock(&cp->lock);
+	return obj;
+}
+
+//
+// Return an object to the cache it was allocated from.
+// The slab is found by rounding the address down to the slab size,
+// which works because page_alloc_order() blocks are size-aligned.
+//
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_slab *sp;
+
+	sp = ROUNDDOWN(obj, PGSIZE << cp->order);
+	if (sp->cache != cp)
+		panic("kmem_cache_free: %p is not from %s", obj, cp->name);
+
+	spin_lock(&cp->lock);
+	assert(sp->inuse > 0);
+	FREEPTR(cp, obj) = sp->free;
+	sp->free = obj;
+	cp->nalloc--;
+
+	if (sp->inuse-- == cp->nobjs) {
+		LIST_REMOVE(sp, link);
+		LIST_INSERT_HEAD(&cp->partial, sp, link);
+	}
+	if (sp->inuse == 0) {
+		LIST_REMOVE(sp, link);
+		if (cp->nempty < KMEM_EMPTY_MAX) {
+			LIST_INSERT_HEAD(&cp->empty, sp, link);
+			cp->nempty++;
+		} else
+			kmem_slab_release(cp, sp);
+	}
+	spin_unlock(&cp->lock);
+}
+
+static int kmem_check_ctor_calls;
+
+static void
+kmem_check_ctor(void *obj)
+{
+	memset(obj, 0x5a, 200);
+	kmem_check_ctor_calls++;
+}
+
+//
+// Check the slab allocator: objects are distinct, aligned and
+// colored, constructed state survives a free, and empty slabs go
+// back to the page allocator.
+//
+static void
+kmem_check(void)
+{
+	struct kmem_cache *cp;
+	void *objs[64];
+	char *o;
+	int i, j;
+
+	// 208-byte chunks: 19 per page, leaving 112 bytes for coloring
+	cp = kmem_cache_create("check", 200, 16, kmem_check_ctor);
+	assert(cp != NULL);
+	assert(cp->chunk == 208 && cp->order == 0 && cp->nobjs == 19);
+
+	for (i = 0; i < 64; i++) {
+		objs[i] = kmem_cache_alloc(cp);
+		assert(objs[i] != NULL);
+		assert(((uintptr_t) objs[i] & 15) == 0);
+		for (o = objs[i], j = 0; j < 200; j++)
+			assert(o[j] == 0x5a);
+		for (j = 0; j < i; j++)
+			assert(objs[j] != objs[i]);
+	}
+	assert(cp->nslabs == 4 && cp->nalloc == 64);
+	assert(kmem_check_ctor_calls == 4 * cp->nobjs);
+
+	// The second slab is colored one cache line further in.
+	assert(ROUNDDOWN(objs[0], PGSIZE) != ROUNDDOWN(objs[cp->nobjs], PGSIZE));
+	assert(PGOFF(objs[cp->nobjs]) - PGOFF(objs[0]) == CACHELINE);
+
+	// Frees push, allocations pop.
+	kmem_cache_free(cp, objs[5]);
+	assert(kmem_cache_alloc(cp) == objs[5]);
+	for (o = objs[5], j = 0; j < 200; j++)
+		assert(o[j] == 0x5a);
+
+	for (i = 0; i < 64; i++)
+		kmem_cache_free(cp, objs[i]);
+	assert(cp->nalloc == 0 && cp->nslabs == KMEM_EMPTY_MAX);
+	kmem_cache_destroy(cp);
+
+	// 256-byte chunks aligned to 128: 15 per page after the 128-byte
+	// header, leaving 128 bytes, one color step
+	cp = kmem_cache_create("check128", 200, 128, NULL);
+	assert(cp != NULL);
+	assert(cp->chunk == 256 && cp->nobjs == 15 && cp->color_step == 128);
+	for (i = 0; i < 3 * cp->nobjs; i++) {
+		objs[i] = kmem_cache_alloc(cp);
+		assert(objs[i] != NULL && ((uintptr_t) objs[i] & 127) == 0);
+	}
+	assert(PGOFF(objs[cp->nobjs]) - PGOFF(objs[0]) == 128);
+	assert(PGOFF(objs[2 * cp->nobjs]) == PGOFF(objs[0]));
+	for (i = 0; i < 3 * cp->nobjs; i++)
+		kmem_cache_free(cp, objs[i]);
+	kmem_cache_destroy(cp);
+	assert(kmem_cache_cache.nalloc == 0);
+
+	// Too big for a slab
+	assert(kmem_cache_create("huge", PGSIZE << KMEM_MAX_ORDER, 0, NULL) == NULL);
+
+	cprintf("kmem_check() succeeded!\n");
+}
@@ -0,0 +1,60 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/queue.h>
+#include <kern/spinlock.h>
+
+// Object caches ("slabs") for small fixed-size kernel objects.
+// A cache carves blocks from page_alloc_order() into equal objects, so
+// allocating and freeing an object is a free-list push or pop and never
+// touches the page allocator in the common case.
+
+#define CACHELINE	64
+
+#define KMEM_NAMELEN	16
+#define KMEM_MAX_ORDER	3	// largest slab: 8 pages
+#define KMEM_MIN_OBJS	8	// grow the slab until it holds this many
+
+struct kmem_slab;
+LIST_HEAD(kmem_slab_list, kmem_slab);
+
+struct kmem_cache {
+	char name[KMEM_NAMELEN];
+	size_t objsize;			// requested object size
+	size_t chunk;			// space per object, a multiple of align
+	size_t align;
+	size_t freeoff;			// offset of the free-list pointer
+	void (*ctor)(void *obj);	// run once per object, when its slab is made
+
+	int order;			// each slab is 2^order pages
+	int nobjs;			// objects per slab
+	size_t color;			// offset of the first object in the next slab
+	size_t color_step;		// a cache line, or align if larger
+	size_t color_max;
+
+	struct spinlock lock;
+	struct kmem_slab_list partial;	// slabs with free and used objects
+	struct kmem_slab_list full;
+	struct kmem_slab_list empty;
+	int nempty;
+
+	uint32_t nslabs;
+	uint32_t nalloc;		// objects in use
+
+	LIST_ENTRY(kmem_cache) link;	// on kmem_caches
+};
+
+void	kmem_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *));
+void	kmem_cache_destroy(struct kmem_cache *cp);
+void *	kmem_cache_alloc(struct kmem_cache *cp);
+void	kmem_cache_free(struct kmem_cache *cp, void *obj);
+
+#endif /* !JOS_KERN_KMEM_H */
@@ -10,9 +10,17 @@
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
+#include <kern/pmap.h>
+#include <kern/klog.h>
 #include <kern/trap.h>
 
 #include <inc/hvm/vt.h>
+#include <inc/hvm/vt_vm.h>
+#include <inc/hvm/vt_trace.h>
+#include <inc/hvm/vt_prof.h>
+#include <inc/hvm/vt_hypercall.h>
+#include <inc/hvm/constants.h>
+#include <inc/hvm/asm.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -26,10 +34,15 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
+	{ "meminfo", "Display physical memory usage", mon_meminfo },
+	{ "dmesg", "Display the kernel log", mon_dmesg },
 	{ "backtrace", "Display back trace information of function", mon_backtrace },
     { "exit", "Exit from trap monitor", mon_exit },
-    { "matrix", "Build a Matrix", mon_matrix },
+    { "matrix", "Build a Matrix [create|run|list|pause|resume|destroy|snapshot|restore]", mon_matrix },
     { "cpuid", "Instruction cpuid", mon_cpuid },
+    { "host", "Leave the Matrix for the host's monitor", mon_host },
+	{ "vtrace", "VM exit trace [on|off|clear|dump]", mon_vtrace },
+	{ "hvprof", "Hypervisor profile [on [period]|off|clear]", mon_hvprof },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -62,6 +75,42 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+static const char *page_owner_name[NPGO] = {
+	[PGO_KERNEL] = "kernel",
+	[PGO_EPT] = "ept",
+	[PGO_VMX] = "vmcs/vmxon",
+	[PGO_GUEST] = "guest",
+	[PGO_DEVICE] = "device",
+};
+
+static void
+meminfo_line(const char *name, size_t n)
+{
+	cprintf("  %-11s %8u pages %9uK\n", name, n, n * (PGSIZE / 1024));
+}
+
+int
+mon_meminfo(int argc, char **argv, struct Trapframe *tf)
+{
+	struct page_stat st;
+	int i;
+
+	page_stat(&st);
+	meminfo_line("ram", st.ram);
+	meminfo_line("free", st.free);
+	meminfo_line("boot", st.boot);
+	for (i = 0; i < NPGO; i++)
+		meminfo_line(page_owner_name[i], st.used[i]);
+	return 0;
+}
+
+int
+mon_dmesg(int argc, char **argv, struct Trapframe *tf)
+{
+	klog_dump();
+	return 0;
+}
+
 int
 mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 {
@@ -124,10 +173,89 @@ mon_exit(int argc, char **argv, struct Trapframe *tf)
     return 0;
 }
 
+static const char *vm_state_name[] = {
+	[VM_FREE] = "free",
+	[VM_RUNNABLE] = "runnable",
+	[VM_PAUSED] = "paused",
+	[VM_HALTED] = "halted",
+	[VM_STOPPED] = "stopped",
+	[VM_SNAPSHOT] = "snapshot",
+};
+
 int
 mon_matrix(int argc, char **argv, struct Trapframe *tf)
 {
-	vt_main();
+	struct vm *vm = NULL;
+	int i, r;
+
+	// With no subcommand, build one Matrix and enter it, as before.
+	if (argc < 2) {
+		vt_main();
+		return 0;
+	}
+
+	if (strcmp(argv[1], "create") == 0) {
+		if ((r = vm_create(&vm)) < 0)
+			cprintf("matrix: %e\n", r);
+		else
+			cprintf("VM %d created\n", vm->id);
+		return 0;
+	}
+	if (strcmp(argv[1], "run") == 0) {
+		cprintf("Running VMs, type 'host' in a guest's monitor to return here\n");
+		vm_sched();
+		return 0;
+	}
+	if (strcmp(argv[1], "list") == 0) {
+		cprintf("  id state      memory  balloon exits\n");
+		for (i = 0; i < NVM; i++)
+			if (vms[i] != NULL)
+				cprintf("%c%3d %-10s %6uK %7uK %llu\n",
+					vms[i] == vm_console ? '*' : ' ',
+					vms[i]->id, vm_state_name[vms[i]->state],
+					(uint32_t) (vms[i]->memsize / 1024),
+					vms[i]->nballoon * (PGSIZE / 1024),
+					vms[i]->nexits);
+		cprintf("emulator: %llu emulated, %llu decoded, %llu cache hits,"
+			" %llu code page writes, %llu mixed pages\n",
+			vt_emulate_stats.nemulated, vt_emulate_stats.ndecoded,
+			vt_emulate_stats.ngen_hits,
+			vt_emulate_stats.ncode_writes,
+			vt_emulate_stats.nmixed_pages);
+		return 0;
+	}
+
+	if (argc < 3 || (vm = vm_lookup(strtol(argv[2], 0, 0))) == NULL) {
+		cprintf("Usage: matrix [create|run|list]\n"
+			"       matrix pause|resume|destroy|snapshot|restore <id>\n");
+		return 0;
+	}
+	if (strcmp(argv[1], "snapshot") == 0 ||
+	    strcmp(argv[1], "restore") == 0) {
+		struct vm *clone;
+
+		if ((r = vm_fork(vm, &clone)) < 0) {
+			cprintf("matrix: %e\n", r);
+			return 0;
+		}
+		if (argv[1][0] == 's') {
+			clone->state = VM_SNAPSHOT;
+			cprintf("VM %d is a snapshot of VM %d\n", clone->id, vm->id);
+		} else {
+			clone->state = VM_RUNNABLE;
+			vt_vga_show(clone);
+			cprintf("VM %d restored from VM %d\n", clone->id, vm->id);
+		}
+	} else if (strcmp(argv[1], "pause") == 0) {
+		if (vm->state == VM_RUNNABLE || vm->state == VM_HALTED)
+			vm->state = VM_PAUSED;
+	} else if (strcmp(argv[1], "resume") == 0) {
+		if (vm->state == VM_PAUSED || vm->state == VM_HALTED)
+			vm->state = VM_RUNNABLE;
+	} else if (strcmp(argv[1], "destroy") == 0)
+		vm_destroy(vm);
+	else
+		cprintf("matrix: unknown command '%s'\n", argv[1]);
 	return 0;
 }
 
@@ -143,6 +271,71 @@ mon_cpuid(int argc, char **argv, struct Trapframe *tf)
 	cprintf("%#x\n", oa);
 	return 0;
 }
+
+// In a guest, give the console back to the host's monitor.  The host
+// sets the CPUID hypervisor bit, so this is a no-op on bare metal.
+int
+mon_host(int argc, char **argv, struct Trapframe *tf)
+{
+	u32 oc, nr = HC_HOST_MONITOR;
+
+	cpuid(CPUID_1, NULL, NULL, &oc, NULL);
+	if (!(oc & CPUID_1_ECX_HYPERVISOR_BIT)) {
+		cprintf("host: not in the Matrix\n");
+		return 0;
+	}
+	asm volatile(ASM_VMCALL : "+a" (nr) : : "memory");
+	return 0;
+}
+
+int
+mon_vtrace(int argc, char **argv, struct Trapframe *tf)
+{
+	int r = 0;
+
+	if (argc < 2)
+		;
+	else if (strcmp(argv[1], "on") == 0)
+		r = vt_trace_start();
+	else if (strcmp(argv[1], "off") == 0)
+		vt_trace_stop();
+	else if (strcmp(argv[1], "clear") == 0)
+		vt_trace_clear();
+	else if (strcmp(argv[1], "dump") == 0) {
+		if ((r = vt_trace_dump()) == 0)
+			cprintf("vtrace: sent %u records to the serial port\n",
+				vt_trace_count());
+	} else {
+		cprintf("Usage: vtrace [on|off|clear|dump]\n");
+		return 0;
+	}
+	if (r < 0)
+		cprintf("vtrace: %e\n", r);
+	cprintf("vtrace: %s, %u records\n", vt_trace_on ? "on" : "off",
+		vt_trace_count());
+	return 0;
+}
+
+// With no arguments, report the samples taken so far.
+int
+mon_hvprof(int argc, char **argv, struct Trapframe *tf)
+{
+	int r = 0;
+
+	if (argc < 2)
+		hvprof_report();
+	else if (strcmp(argv[1], "on") == 0)
+		r = hvprof_start(argc > 2 ? strtol(argv[2], 0, 0) : 16);
+	else if (strcmp(argv[1], "off") == 0)
+		hvprof_stop();
+	else if (strcmp(argv[1], "clear") == 0)
+		hvprof_clear();
+	else
+		cprintf("Usage: hvprof [on [period]|off|clear]\n");
+	if (r < 0)
+		cprintf("hvprof: %e\n", r);
+	return 0;
+}
 	
 
 /***** Kernel monitor command interpreter *****/
@@ -14,9 +14,14 @@ void monitor(struct Trapframe *tf);
 // Functions implementing monitor commands.
 int mon_help(int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
+int mon_meminfo(int argc, char **argv, struct Trapframe *tf);
+int mon_dmesg(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 int mon_exit(int argc, char **argv, struct Trapframe *tf);
 int mon_matrix(int argc, char **argv, struct Trapframe *tf);
 int mon_cpuid(int argc, char **argv, struct Trapframe *tf);
+int mon_host(int argc, char **argv, struct Trapframe *tf);
+int mon_vtrace(int argc, char **argv, struct Trapframe *tf);
+int mon_hvprof(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -0,0 +1,207 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/trap.h>
+
+#include <kern/picirq.h>
+#include <kern/console.h>
+
+
+// Current IRQ mask.
+// Initial IRQ mask has interrupt 2 enabled (for slave 8259A).
+uint16_t irq_mask_8259A = 0xFFFF & ~(1<<IRQ_SLAVE);
+static bool didinit;
+
+// The guests drive the hardware directly, so the PIC is switched between
+// our layout, while the kernel waits for console input, and the one the
+// running guest programmed.  A guest starts out with the PIC the way
+// the BIOS left it; its writes to the PIC are trapped and go through
+// pic_guest_write(), which keeps track of them.
+static uint16_t bios_mask;
+static bool host_owned;
+static struct pic_regs guest_loaded[2];	// what the PIC holds for a guest
+
+// Program both 8259As to deliver IRQs at vectors base1 and base2.
+// aeoi selects automatic EOI, which saves us sending EOIs.
+static void
+pic_program(uint8_t base1, uint8_t base2, bool aeoi, uint16_t mask)
+{
+	// mask all interrupts
+	outb(IO_PIC1+1, 0xFF);
+	outb(IO_PIC2+1, 0xFF);
+
+	// Set up master (8259A-1)
+
+	// ICW1:  0001g0hi
+	//    g:  0 = edge triggering, 1 = level triggering
+	//    h:  0 = cascaded PICs, 1 = master only
+	//    i:  0 = no ICW4, 1 = ICW4 required
+	outb(IO_PIC1, 0x11);
+
+	// ICW2:  Vector offset
+	outb(IO_PIC1+1, base1);
+
+	// ICW3:  bit mask of IR lines connected to slave PICs (master PIC),
+	//        3-bit No of IR line at which slave connects to master(slave PIC).
+	outb(IO_PIC1+1, 1<<IRQ_SLAVE);
+
+	// ICW4:  000nbmap
+	//    n:  1 = special fully nested mode
+	//    b:  1 = buffered mode
+	//    m:  0 = slave PIC, 1 = master PIC
+	//	  (ignored when b is 0, as the master/slave role
+	//	  can be hardwired).
+	//    a:  1 = Automatic EOI mode
+	//    p:  0 = MCS-80/85 mode, 1 = intel x86 mode
+	outb(IO_PIC1+1, aeoi ? 0x3 : 0x1);
+
+	// Set up slave (8259A-2)
+	outb(IO_PIC2, 0x11);			// ICW1
+	outb(IO_PIC2+1, base2);			// ICW2
+	outb(IO_PIC2+1, IRQ_SLAVE);		// ICW3
+	// NB Automatic EOI mode doesn't tend to work on the slave.
+	// Linux source code says it's "to be investigated".
+	outb(IO_PIC2+1, 0x01);			// ICW4
+
+	// OCW3:  0ef01prs
+	//   ef:  0x = NOP, 10 = clear specific mask, 11 = set specific mask
+	//    p:  0 = no polling, 1 = polling mode
+	//   rs:  0x = NOP, 10 = read IRR, 11 = read ISR
+	outb(IO_PIC1, 0x68);             /* clear specific mask */
+	outb(IO_PIC1, 0x0a);             /* read IRR by default */
+
+	outb(IO_PIC2, 0x68);               /* OCW3 */
+	outb(IO_PIC2, 0x0a);               /* OCW3 */
+
+	outb(IO_PIC1+1, (char)mask);
+	outb(IO_PIC2+1, (char)(mask >> 8));
+}
+
+/* Initialize the 8259A interrupt controllers. */
+void
+pic_init(void)
+{
+	didinit = 1;
+	bios_mask = inb(IO_PIC1+1) | (inb(IO_PIC2+1) << 8);
+	pic_host();
+}
+
+// Take the PIC for the kernel: IRQs at IRQ_OFFSET, only ours unmasked.
+void
+pic_host(void)
+{
+	if (host_owned)
+		return;
+	pic_program(IRQ_OFFSET, IRQ_OFFSET + 8, 1, irq_mask_8259A);
+	host_owned = 1;
+	serial_txi_allow(1);
+}
+
+// Fill in regs with the PIC the way the BIOS set it up.
+void
+pic_bios_regs(struct pic_regs regs[2])
+{
+	regs[0].icw[0] = regs[1].icw[0] = 0x11;
+	regs[0].icw[1] = BIOS_IRQ_OFFSET1;
+	regs[1].icw[1] = BIOS_IRQ_OFFSET2;
+	regs[0].icw[2] = 1<<IRQ_SLAVE;
+	regs[1].icw[2] = IRQ_SLAVE;
+	regs[0].icw[3] = regs[1].icw[3] = 0x01;
+	regs[0].next = regs[1].next = 0;
+	regs[0].mask = bios_mask;
+	regs[1].mask = bios_mask >> 8;
+	regs[0].ocw3 = regs[1].ocw3 = 0x4a;
+}
+
+// Does the ICW with index i follow ICW1 'icw1'?  ICW3 is left out
+// without cascading, ICW4 unless asked for.
+static bool
+pic_has_icw(uint8_t icw1, int i)
+{
+	return !(i == 2 && (icw1 & 0x02)) && !(i == 3 && !(icw1 & 0x01));
+}
+
+// Program one 8259A at 'port' from r, stopping where the guest had got
+// to if it was in the middle of initializing it.
+static void
+pic_load(int port, const struct pic_regs *r)
+{
+	int i;
+
+	outb(port, r->icw[0]);
+	for (i = 1; i < (r->next ? r->next : 4); i++)
+		if (pic_has_icw(r->icw[0], i))
+			outb(port+1, r->icw[i]);
+	if (r->next == 0) {
+		outb(port, r->ocw3);
+		outb(port+1, r->mask);
+	}
+}
+
+// Give the PIC to a guest, programmed the way the guest left it.
+// Reprogramming loses pending IRQs, so skip it if the PIC already
+// holds regs.
+void
+pic_guest(const struct pic_regs regs[2])
+{
+	if (!host_owned && memcmp(guest_loaded, regs, sizeof(guest_loaded)) == 0)
+		return;
+	serial_txi_allow(0);
+	outb(IO_PIC1+1, 0xFF);
+	outb(IO_PIC2+1, 0xFF);
+	pic_load(IO_PIC1, &regs[0]);
+	pic_load(IO_PIC2, &regs[1]);
+	memmove(guest_loaded, regs, sizeof(guest_loaded));
+	host_owned = 0;
+}
+
+// Do a guest's write of val to PIC port 'port', which the guest owns,
+// and keep track of it in regs.
+void
+pic_guest_write(struct pic_regs regs[2], int port, uint8_t val)
+{
+	struct pic_regs *r = &regs[(port & ~1) == IO_PIC2];
+
+	outb(port, val);
+	if (!(port & 1) && (val & 0x10)) {
+		// ICW1 starts over: it clears the mask and selects IRR reads
+		r->icw[0] = val;
+		r->next = 1;
+		r->mask = 0;
+		r->ocw3 = 0x4a;
+	} else if (!(port & 1)) {
+		// OCW3; OCW2s (EOIs, rotations) leave nothing to put back,
+		// nor does a poll
+		if ((val & 0x18) == 0x08 && (val & 0x40))
+			r->ocw3 = (r->ocw3 & ~0x20) | (val & 0x20);
+		if ((val & 0x18) == 0x08 && (val & 0x02))
+			r->ocw3 = (r->ocw3 & ~0x01) | (val & 0x01);
+	} else if (r->next == 0)
+		r->mask = val;
+	else {
+		r->icw[r->next++] = val;
+		while (r->next < 4 && !pic_has_icw(r->icw[0], r->next))
+			r->next++;
+		if (r->next == 4)
+			r->next = 0;
+	}
+	guest_loaded[r - regs] = *r;
+}
+
+void
+irq_setmask_8259A(uint16_t mask)
+{
+	int i;
+	irq_mask_8259A = mask;
+	if (!didinit || !host_owned)
+		return;
+	outb(IO_PIC1+1, (char)mask);
+	outb(IO_PIC2+1, (char)(mask >> 8));
+	cprintf("enabled interrupts:");
+	for (i = 0; i < 16; i++)
+		if (~mask & 1<<i)
+			cprintf(" %d", i);
+	cprintf("\n");
+}
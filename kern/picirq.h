@@ -0,0 +1,45 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PICIRQ_H
+#define JOS_KERN_PICIRQ_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#define MAX_IRQS	16	// Number of IRQs
+
+// I/O Addresses of the two 8259A programmable interrupt controllers
+#define IO_PIC1		0x20	// Master (IRQs 0-7)
+#define IO_PIC2		0xA0	// Slave (IRQs 8-15)
+
+#define IRQ_SLAVE	2	// IRQ at which slave connects to master
+
+// Where the BIOS puts the IRQs, and where real-mode guests expect them
+#define BIOS_IRQ_OFFSET1	0x08
+#define BIOS_IRQ_OFFSET2	0x70
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+#include <inc/x86.h>
+
+// What a guest last programmed into one 8259A, so that pic_guest() can
+// put it back after the kernel has had the PIC.
+struct pic_regs {
+	uint8_t icw[4];		// ICW1-ICW4 of the last initialization
+	uint8_t next;		// next ICW the data port takes, 0 when done
+	uint8_t mask;		// OCW1
+	uint8_t ocw3;		// OCW3 that restores special mask mode and
+				// the register the command port reads
+};
+
+extern uint16_t irq_mask_8259A;
+void pic_init(void);
+void pic_host(void);
+void pic_bios_regs(struct pic_regs regs[2]);
+void pic_guest(const struct pic_regs regs[2]);
+void pic_guest_write(struct pic_regs regs[2], int port, uint8_t val);
+void irq_setmask_8259A(uint16_t mask);
+#endif // !__ASSEMBLER__
+
+#endif // !JOS_KERN_PICIRQ_H
@@ -5,18 +5,90 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/multiboot.h>
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_mem_detect()
 size_t npages;			// Amount of physical memory (in pages)
-static size_t n_base_pages;	// Amount of base memory (in pages)
+size_t npages_direct;		// Pages mapped at KERNBASE
+
+// Usable RAM, sorted by address.  Everything else is a hole, a ROM or
+// a device, and page_init() never hands it out.
+#define NMEMRANGE	32
+
+struct mem_range {
+	physaddr_t start;
+	physaddr_t end;
+};
+
+static struct mem_range mem_ranges[NMEMRANGE];
+static int nmem_ranges;
 
 // These variables are set in boot_mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
+static pde_t kern_pdpt[NPDPENTRIES]	// Points to the four pages of kern_pgdir
+	__attribute__((aligned(32)));
 struct Page *pages;		// Physical page state array
 
-static struct Page_list page_free_list;	// Free list of physical pages
+// Free blocks of physical pages, one list per zone and block order.
+// Pages in the KERNBASE window and high memory pages are kept apart, so
+// that only PAGE_HIGH callers, who use kmap(), get high memory.  The
+// zone boundary is aligned to the largest block, so buddies never
+// straddle it.
+#define ZONE_DIRECT	0
+#define ZONE_HIGH	1
+#define NZONE		2
+
+#define page_zone(ppn)	((ppn) < npages_direct ? ZONE_DIRECT : ZONE_HIGH)
+
+static struct Page_list page_free_lists[NZONE][PAGE_MAX_ORDER + 1];
+static struct spinlock page_lock;	// protects page_free_lists
+
+// Per-CPU magazines: small LIFO stacks of free single pages in front of
+// the free lists.  page_alloc and page_free only take page_lock when a
+// magazine runs empty or full, and then move PAGE_MAG_BATCH pages at once.
+#define PAGE_MAG_SIZE	64
+#define PAGE_MAG_BATCH	32
+
+struct page_magazine {
+	int n;
+	struct Page *pages[PAGE_MAG_SIZE];
+};
+
+static struct page_magazine page_mags[NCPU];
+
+// Pages allocated, by CPU and owner.  The counts are per CPU so that
+// page_alloc and page_free need no lock for them; a page freed on
+// another CPU than it was allocated on makes a count go negative, but
+// the sums are right.  Together with page_ntotal they give the number
+// of free pages without walking any list.
+static int page_used[NCPU][NPGO];
+static size_t page_ntotal;	// pages page_init() gave the allocator
+static size_t mem_ram_pages;	// pages of RAM, set by i386_mem_detect()
+
+// Pool of pages whose memory is already zero, for PAGE_ZERO allocations.
+// page_zero_idle() refills it when the CPU has nothing else to do.
+#define PAGE_ZERO_POOL	64
+
+static struct Page *zero_pool[PAGE_ZERO_POOL];
+static int zero_pool_n;			// protected by page_lock
+
+// Temporary mappings for high memory pages: one page table entry per
+// slot of the [KMAPBASE, KMAPBASE + KMAPSIZE) window.
+#define NKMAP		(KMAPSIZE / PGSIZE)
+
+static pte_t *kmap_ptes;
+static uint32_t kmap_used[NKMAP / 32];
+static struct spinlock kmap_lock;
+
+#define CPUID_FEATURES_EDX_PAE	0x00000040
+
+// Memory above this is ignored, since pages[] has to fit in the
+// KERNBASE window along with everything else.
+#define MAXPHYSMEM	0x400000000ULL	// 16GB
 
 extern char bootstack[];	// Lowest addr in boot-time kernel stack
 
@@ -57,25 +129,127 @@ nvram_read(int r)
 	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
 }
 
+// Add [start, end) to the usable memory ranges, shrunk to whole pages.
+// Ranges are kept sorted; touching or overlapping ones are merged.
+static void
+mem_range_add(uint64_t start, uint64_t end)
+{
+	struct mem_range *r;
+	int i;
+
+	if (end > MAXPHYSMEM)
+		end = MAXPHYSMEM;
+	start = ROUNDUP(start, PGSIZE);
+	end = ROUNDDOWN(end, PGSIZE);
+	if (start >= end)
+		return;
+
+	for (i = 0; i < nmem_ranges; i++) {
+		r = &mem_ranges[i];
+		if (start <= r->end && end >= r->start) {
+			r->start = MIN(r->start, (physaddr_t) start);
+			r->end = MAX(r->end, (physaddr_t) end);
+			// Swallow the ranges the grown one now reaches.
+			while (i + 1 < nmem_ranges && mem_ranges[i + 1].start <= r->end) {
+				r->end = MAX(r->end, mem_ranges[i + 1].end);
+				memmove(&mem_ranges[i + 1], &mem_ranges[i + 2],
+					(nmem_ranges - i - 2) * sizeof(*r));
+				nmem_ranges--;
+			}
+			return;
+		}
+		if (end < r->start)
+			break;
+	}
+
+	if (nmem_ranges == NMEMRANGE) {
+		cprintf("mem_range_add: too many ranges, dropping [%08llx, %08llx)\n",
+			start, end);
+		return;
+	}
+	memmove(&mem_ranges[i + 1], &mem_ranges[i],
+		(nmem_ranges - i) * sizeof(mem_ranges[0]));
+	mem_ranges[i].start = start;
+	mem_ranges[i].end = end;
+	nmem_ranges++;
+}
+
+// Read the memory map a multiboot loader such as GRUB left for us.
+// Returns false if we were not booted by one or it gave no map.
+static bool
+multiboot_mem_detect(void)
+{
+	extern uint32_t multiboot_magic, multiboot_info;
+	struct multiboot_info *mbi;
+	struct multiboot_mmap_entry *e;
+	uintptr_t p, end;
+
+	if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC)
+		return false;
+	// KADDR would check against npages, which isn't known yet.
+	mbi = (struct multiboot_info *) (multiboot_info + KERNBASE);
+
+	if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+		p = mbi->mmap_addr + KERNBASE;
+		end = p + mbi->mmap_length;
+		for (; p < end; p += e->size + sizeof(e->size)) {
+			e = (struct multiboot_mmap_entry *) p;
+			if (e->type == MULTIBOOT_MEMORY_AVAILABLE)
+				mem_range_add(e->addr, e->addr + e->len);
+		}
+	} else if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
+		mem_range_add(0, mbi->mem_lower * 1024);
+		mem_range_add(EXTPHYSMEM, EXTPHYSMEM + mbi->mem_upper * 1024ULL);
+	}
+	return nmem_ranges > 0;
+}
+
 static void
 i386_mem_detect(void)
 {
-	uint32_t n_extended_pages;
-	
-	// Use CMOS calls to measure available base & extended memory.
-	// (CMOS calls return results in kilobytes.)
-	n_base_pages = nvram_read(NVRAM_BASELO) * 1024 / PGSIZE;
-	n_extended_pages = nvram_read(NVRAM_EXTLO) * 1024 / PGSIZE;
-
-	// Calculate the maximum physical address based on whether
-	// or not there is any extended memory.  See comment in <inc/mmu.h>.
-	if (n_extended_pages)
-		npages = (EXTPHYSMEM / PGSIZE) + n_extended_pages;
-	else
-		npages = n_base_pages;
+	physaddr_t top, total;
+	int i;
+
+	// Prefer the boot loader's e820 map, which covers all of memory
+	// and its holes.  Otherwise use CMOS calls to measure base and
+	// extended memory (CMOS calls return results in kilobytes).
+	if (!multiboot_mem_detect()) {
+		mem_range_add(0, nvram_read(NVRAM_BASELO) * 1024);
+		mem_range_add(EXTPHYSMEM,
+			      EXTPHYSMEM + nvram_read(NVRAM_EXTLO) * 1024);
+	}
+	if (nmem_ranges == 0)
+		panic("i386_mem_detect: no memory");
+
+	// Only the memory in the KERNBASE window is mapped all the time.
+	// The rest is high memory, mapped page by page with kmap(); with
+	// PAE paging, that includes memory above 4GB.
+	top = mem_ranges[nmem_ranges - 1].end;
+	npages = PPN(top);
+	npages_direct = MIN(npages, (size_t) -KERNBASE / PGSIZE);
+
+	total = 0;
+	for (i = 0; i < nmem_ranges; i++)
+		total += mem_ranges[i].end - mem_ranges[i].start;
+	mem_ram_pages = PPN(total);
+	cprintf("Physical memory: %dK available in %d ranges, top = %dK",
+		(int) (total >> 10), nmem_ranges, (int) (top >> 10));
+	if (npages > npages_direct)
+		cprintf(", high = %dK",
+			(int) ((npages - npages_direct) * (PGSIZE / 1024)));
+	cprintf("\n");
+}
 
-	cprintf("Physical memory: %dK available, ", (int)(npages * PGSIZE / 1024));
-	cprintf("base = %dK, extended = %dK\n", (int)(n_base_pages * PGSIZE / 1024), (int)(n_extended_pages * PGSIZE / 1024));
+// Is the page at 'pa' usable RAM?
+static bool
+mem_is_ram(physaddr_t pa)
+{
+	int i;
+
+	for (i = 0; i < nmem_ranges; i++)
+		if (pa >= mem_ranges[i].start && pa < mem_ranges[i].end)
+			return true;
+	return false;
 }
 
 
@@ -86,6 +260,7 @@ i386_mem_detect(void)
 static void *boot_alloc(uint32_t n);
 static pte_t *boot_pgdir_walk(uintptr_t la, bool create);
 static void boot_map_segment(uintptr_t la, size_t size, physaddr_t pa, int perm);
+static void boot_map_segment_large(uintptr_t la, size_t size, physaddr_t pa, int perm);
 static void boot_mem_check(void);
 
 
@@ -93,7 +268,8 @@ static void boot_mem_check(void);
 //
 // Sets up the kernel's page directory 'kern_pgdir' (which contains those
 // virtual memory mappings common to all user environments), installs that
-// page directory, and turns on paging.  Then effectively turns off segments.
+// page directory, and turns on PAE paging.  Then effectively turns off
+// segments.
 // 
 // This function only sets up the kernel part of the address space
 // (ie. addresses >= UTOP).  The user part of the address space
@@ -104,28 +280,39 @@ static void boot_mem_check(void);
 void
 boot_mem_init(void)
 {
-	uint32_t cr0;
-	size_t n;
+	uint32_t cr0, edx;
+	size_t i;
 	
 	// Remove this line when you're ready to test this function.
 	//panic("boot_mem_init: This function is not finished\n");
 
-	// Find out how much memory the machine has ('npages' & 'n_base_pages')
+	// Physical memory above 4GB is only reachable with PAE paging,
+	// which every CPU since the Pentium Pro has.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (!(edx & CPUID_FEATURES_EDX_PAE))
+		panic("boot_mem_init: CPU has no PAE");
+
+	// Find out how much memory the machine has ('npages' & 'mem_ranges')
 	i386_mem_detect();
 	
 	// Allocate the kernel's initial page directory, 'kern_pgdir'.
 	// This starts out empty (all zeros).  Any virtual
 	// address lookup using this empty 'kern_pgdir' would fault.
 	// Then we add mappings to 'kern_pgdir' as we go long.
-	kern_pgdir = boot_alloc(PGSIZE);
-	memset(kern_pgdir, 0, PGSIZE);
-
-	// Recursively insert 'kern_pgdir' in itself as a page table, to form
+	// PAE paging has four page directories, one per PDPT entry; they
+	// are allocated together, so 'kern_pgdir' can be indexed by PDX.
+	kern_pgdir = boot_alloc(NPDPENTRIES * PGSIZE);
+	memset(kern_pgdir, 0, NPDPENTRIES * PGSIZE);
+	for (i = 0; i < NPDPENTRIES; i++)
+		kern_pdpt[i] = (PADDR(kern_pgdir) + i * PGSIZE) | PTE_P;
+
+	// Recursively insert 'kern_pgdir' in itself as page tables, to form
 	// virtual page tables at virtual addresses VPT and UVPT.
 	// (For now, you don't have understand the greater purpose of the
-	// following two lines.)
+	// following lines.)
 	// VPT permissions: kernel RW, user NONE
-	kern_pgdir[PDX(VPT)] = PADDR(kern_pgdir) | PTE_W | PTE_P;
+	for (i = 0; i < NPDPENTRIES; i++)
+		kern_pgdir[PDX(VPT) + i] = (PADDR(kern_pgdir) + i * PGSIZE) | PTE_W | PTE_P;
 	
 	// Map the kernel stack at virtual address 'KSTACKTOP-KSTKSIZE'.
 	// A large range of virtual memory, [KSTACKTOP-PTSIZE, KSTACKTOP),
@@ -142,6 +329,10 @@ boot_mem_init(void)
 	// LAB 2: Your code here.
     boot_map_segment(KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W);
 
+	// The kmap() window shares its page table with the kernel stack.
+	// Set it up now, so that kmap() never has to allocate.
+	kmap_ptes = boot_pgdir_walk(KMAPBASE, 1);
+
 	// Map all of physical memory at KERNBASE.
 	// I.e., the VA range [KERNBASE, 2^32) should map to
 	//       the PA range [0, 2^32 - KERNBASE).
@@ -149,8 +340,11 @@ boot_mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	//
+	// Use 2MB pages: that needs no page tables at all and far fewer
+	// TLB entries.
+	//
  	// LAB 2: Your code here.
-    boot_map_segment(KERNBASE, 0xffffffffULL - KERNBASE, 0, PTE_W);
+	boot_map_segment_large(KERNBASE, 0xffffffffULL - KERNBASE + 1, 0, PTE_W);
 
 	// Allocate 'pages', an array of 'struct Page' structures, one for
 	// each physical memory page.  So there are 'npages' elements in the
@@ -181,10 +375,15 @@ boot_mem_init(void)
 
 	// Map VA 0:4MB same as VA KERNBASE, i.e. to PA 0:4MB.
 	// (Limits our kernel to <4MB)
-	kern_pgdir[0] = kern_pgdir[PDX(KERNBASE)];
+	for (i = 0; i < 4 * 1024 * 1024 / PTSIZE; i++)
+		kern_pgdir[i] = kern_pgdir[PDX(KERNBASE) + i];
+
+	// The PDPT takes the place of the page directory in CR3, and is
+	// only used as such with CR4.PAE set.
+	lcr4(rcr4() | CR4_PAE);
 
 	// Install page table.
-	lcr3(PADDR(kern_pgdir));
+	lcr3(PADDR(kern_pdpt));
 
 	// Turn on paging.
 	cr0 = rcr0();
@@ -193,7 +392,7 @@ boot_mem_init(void)
 	lcr0(cr0);
 
 	// Current mapping: VA KERNBASE+x => LA x => PA x.
-	// (x < 4MB so uses paging kern_pgdir[0])
+	// (x < 4MB so uses paging kern_pgdir[0] and kern_pgdir[1])
 
 	// Reload all segment registers.
 	asm volatile("lgdt gdt_pd");
@@ -211,10 +410,11 @@ boot_mem_init(void)
 
 	// This mapping was only used after paging was turned on but
 	// before the segment registers were reloaded.
-	kern_pgdir[0] = 0;
+	for (i = 0; i < 4 * 1024 * 1024 / PTSIZE; i++)
+		kern_pgdir[i] = 0;
 
 	// Flush the TLB for good measure, to kill the kern_pgdir[0] mapping.
-	lcr3(PADDR(kern_pgdir));
+	lcr3(PADDR(kern_pdpt));
 }
 
 
@@ -255,7 +455,7 @@ boot_alloc(uint32_t n)
 }
 
 
-// Walk the kernel's 2-level page table structure defined by
+// Walk the kernel's page table structure defined by
 // the page directory 'kern_pgdir' to find the page table entry (PTE)
 // for linear address la.  Return a pointer to this PTE.
 //
@@ -323,6 +523,18 @@ boot_map_segment(uintptr_t la, size_t size, physaddr_t pa, int perm)
         }
 }
 
+// Like boot_map_segment, but with 2MB pages straight in 'kern_pgdir'.
+// la, size and pa must be multiples of PTSIZE.
+static void
+boot_map_segment_large(uintptr_t la, size_t size, physaddr_t pa, int perm)
+{
+	size_t i;
+
+	assert(la % PTSIZE == 0 && size % PTSIZE == 0 && pa % PTSIZE == 0);
+	for (i = 0; i < size; i += PTSIZE)
+		kern_pgdir[PDX(la+i)] = (pa+i) | PTE_PS | PTE_P | perm;
+}
+
 
 
 // This function returns the physical address of the page containing 'va',
@@ -337,6 +549,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PDE_ADDR_LARGE(*pgdir) + (PTX(va) << PGSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -367,12 +581,11 @@ boot_mem_check(void)
 	// check for zero/non-zero in PDEs
 	for (i = 0; i < NPDENTRIES; i++) {
 		switch (i) {
-		case PDX(VPT):
 		case PDX(KSTACKTOP-1):
 			assert(kern_pgdir[i]);
 			break;
 		default:
-			if (i >= PDX(KERNBASE))
+			if (i >= PDX(VPT))
 				assert(kern_pgdir[i]);
 			else
 				assert(kern_pgdir[i] == 0);
@@ -389,13 +602,17 @@ boot_mem_check(void)
 // Pages are reference counted, and free pages are kept on a linked list.
 // --------------------------------------------------------------
 
+static void buddy_free(struct Page *pp, int order);
+
 // Initialize page structure and memory free list.
 // After this point, ONLY use the page_ functions
-// to allocate and deallocate physical memory via the page_free_list,
+// to allocate and deallocate physical memory via the free lists,
 // and NEVER use boot_alloc() or the related boot-time functions above.
 void
 page_init(void)
 {
+	size_t i;
+
 	// The example code here marks all pages as free.
 	// However this is not truly the case.  What memory is free?
 	//  1) Mark page 0 as in use.
@@ -411,8 +628,13 @@ page_init(void)
 	//     if you give it the right argument!)
 	//
 	// Change the code to reflect this.
-	LIST_INIT(&page_free_list);
-	size_t i = 0;
+	spin_initlock(&page_lock);
+	spin_initlock(&kmap_lock);
+	for (i = 0; i <= PAGE_MAX_ORDER; i++) {
+		LIST_INIT(&page_free_lists[ZONE_DIRECT][i]);
+		LIST_INIT(&page_free_lists[ZONE_HIGH][i]);
+	}
+	i = 0;
     for (; i < npages; i++) {
         // Initialize the page structure
         pages[i].pp_ref = 0;
@@ -431,13 +653,34 @@ page_init(void)
         else if (i >= PGNUM(PADDR(KERNBASE)) && i < PGNUM(PADDR(boot_alloc(0)))) {
             continue;
         }
+        // Holes between the memory ranges aren't RAM at all.
+        else if (!mem_is_ram(page2pa(&pages[i]))) {
+            continue;
+        }
 
         //  2) Mark the rest of base memory as free.
-        // Add it to the free list
-		LIST_INSERT_HEAD(&page_free_list, &pages[i], pp_link);
+        // Add it to the free lists, merging it with its free neighbours
+		buddy_free(&pages[i], 0);
+		page_ntotal++;
     }
 }
 
+// Charge a newly allocated block of 2^order pages to 'owner'.
+static void
+page_charge(struct Page *pp, int owner, int order)
+{
+	assert(owner >= 0 && owner < NPGO);
+	pp->pp_flags = owner << PP_OWNER_SHIFT;
+	page_used[cpunum()][owner] += 1 << order;
+}
+
+// Take a block of 2^order pages that is being freed off its owner's count.
+static void
+page_uncharge(struct Page *pp, int order)
+{
+	page_used[cpunum()][pp->pp_flags >> PP_OWNER_SHIFT] -= 1 << order;
+}
+
 // Initialize a Page structure.
 // The result has null links and 0 refcount.
 // Note that the corresponding physical page is NOT initialized!
@@ -447,7 +690,166 @@ page_clear(struct Page *pp)
 	memset(pp, 0, sizeof(*pp));
 }
 
-// Allocate a physical page, without necessarily initializing it.
+// Take a free block of 2^order pages off the free lists of 'zone'.
+// The smallest free block that is large enough is split in halves until
+// it has the requested order; the unused halves go back on the
+// lower-order lists.  Caller holds page_lock.
+static struct Page *
+buddy_alloc(int zone, int order)
+{
+	struct Page_list *lists = page_free_lists[zone];
+	struct Page *pp, *buddy;
+	int o;
+
+	for (o = order; o <= PAGE_MAX_ORDER; o++)
+		if (!LIST_EMPTY(&lists[o]))
+			break;
+	if (o > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = LIST_FIRST(&lists[o]);
+	LIST_REMOVE(pp, pp_link);
+	pp->pp_flags &= ~PP_FREE;
+	while (o > order) {
+		o--;
+		buddy = pp + (1 << o);
+		buddy->pp_order = o;
+		buddy->pp_flags |= PP_FREE;
+		LIST_INSERT_HEAD(&lists[o], buddy, pp_link);
+	}
+	return pp;
+}
+
+// Put a block of 2^order pages back on the free lists.  While the
+// block's buddy (the other half of the next larger block) is free too,
+// the two are merged and the merge repeats one order up.
+// Caller holds page_lock.
+static void
+buddy_free(struct Page *pp, int order)
+{
+	ppn_t ppn, buddy;
+
+	ppn = page2ppn(pp);
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	assert((ppn & ((1 << order) - 1)) == 0);
+	if (pp->pp_flags & PP_FREE)
+		panic("page_free: page %08llx is already free", page2pa(pp));
+
+	for (; order < PAGE_MAX_ORDER; order++) {
+		buddy = ppn ^ (1 << order);
+		if (buddy >= npages || !(pages[buddy].pp_flags & PP_FREE)
+		    || pages[buddy].pp_order != order)
+			break;
+		LIST_REMOVE(&pages[buddy], pp_link);
+		pages[buddy].pp_flags &= ~PP_FREE;
+		ppn &= ~(1 << order);
+	}
+
+	pp = &pages[ppn];
+	pp->pp_order = order;
+	pp->pp_flags |= PP_FREE;
+	LIST_INSERT_HEAD(&page_free_lists[page_zone(ppn)][order], pp, pp_link);
+}
+
+// Allocate a block of 2^order physically contiguous pages, aligned to
+// its size, without necessarily initializing it.
+//
+// *pp_store -- is set to point to the Page struct of the first page
+// of the block.  All Page structs of the block are cleared.
+//
+// flags -- PAGE_OWNER(o) to charge the block to owner 'o', not the kernel
+//          PAGE_ZERO to clear the block's memory
+//          PAGE_HIGH to take high memory if there is any; the caller
+//          must then map the block with kmap(), a page at a time
+//
+// RETURNS
+//   0 -- on success
+//   -E_NO_MEM -- if there is no free block large enough
+//   -E_INVAL -- if order is out of range
+int
+page_alloc_order(struct Page **pp_store, int order, int flags)
+{
+	struct Page *pp;
+	void *kva;
+	int i;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return -E_INVAL;
+
+	spin_lock(&page_lock);
+	pp = NULL;
+	if (flags & PAGE_HIGH)
+		pp = buddy_alloc(ZONE_HIGH, order);
+	if (pp == NULL && order == 0 && (flags & PAGE_ZERO) && zero_pool_n > 0) {
+		pp = zero_pool[--zero_pool_n];
+		flags &= ~PAGE_ZERO;
+	}
+	if (pp == NULL)
+		pp = buddy_alloc(ZONE_DIRECT, order);
+	spin_unlock(&page_lock);
+	if (pp == NULL)
+		return -E_NO_MEM;
+
+	for (i = 0; i < (1 << order); i++)
+		page_clear(&pp[i]);
+	page_charge(pp, flags >> PAGE_OWNER_SHIFT, order);
+	if ((flags & PAGE_ZERO) && page_zone(page2ppn(pp)) == ZONE_HIGH)
+		for (i = 0; i < (1 << order); i++) {
+			kva = kmap(&pp[i]);
+			memset(kva, 0, PGSIZE);
+			kunmap(kva);
+		}
+	else if (flags & PAGE_ZERO)
+		memset(page2kva(pp), 0, PGSIZE << order);
+
+	*pp_store = pp;
+	return 0;
+}
+
+// Return a block of 2^order pages allocated by page_alloc_order.
+void
+page_free_order(struct Page *pp, int order)
+{
+	page_uncharge(pp, order);
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+// Move up to PAGE_MAG_BATCH pages from the free lists into 'mag'.
+// Returns the number of pages moved.
+static int
+page_mag_refill(struct page_magazine *mag)
+{
+	struct Page *pp;
+	int n;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < PAGE_MAG_BATCH; n++) {
+		// Zeroed pages are still free memory; use them as a last resort.
+		if ((pp = buddy_alloc(ZONE_DIRECT, 0)) == NULL && zero_pool_n > 0)
+			pp = zero_pool[--zero_pool_n];
+		if (pp == NULL)
+			break;
+		mag->pages[mag->n++] = pp;
+	}
+	spin_unlock(&page_lock);
+	return n;
+}
+
+// Move PAGE_MAG_BATCH pages from 'mag' back to the free lists.
+static void
+page_mag_drain(struct page_magazine *mag)
+{
+	int n;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < PAGE_MAG_BATCH && mag->n > 0; n++)
+		buddy_free(mag->pages[--mag->n], 0);
+	spin_unlock(&page_lock);
+}
+
+// Allocate a single physical page, without necessarily initializing it.
 //
 // *pp_store -- is set to point to the Page struct of the newly allocated
 // page
@@ -456,7 +858,6 @@ page_clear(struct Page *pp)
 //   0 -- on success
 //   -E_NO_MEM -- otherwise 
 //
-// Hint: use LIST_FIRST, LIST_REMOVE, and page_clear
 // Hint: pp_ref should not be incremented
 // Software Engineering Hint: It can be extremely useful for later debugging
 //   if you erase allocated memory.  For instance, you might write the value
@@ -470,27 +871,141 @@ page_clear(struct Page *pp)
 int
 page_alloc(struct Page **pp_store)
 {
-	// Fill this function in
-    if (LIST_EMPTY(&page_free_list))
-        return -E_NO_MEM;
-
-    *pp_store = LIST_FIRST(&page_free_list);
-    LIST_REMOVE(*pp_store, pp_link);
-    memset(*pp_store, 0, sizeof(**pp_store));
-
+	struct page_magazine *mag = &page_mags[cpunum()];
+	struct Page *pp;
+
+	if (mag->n == 0 && page_mag_refill(mag) == 0)
+		return -E_NO_MEM;
+	pp = mag->pages[--mag->n];
+	page_clear(pp);
+	page_charge(pp, PGO_KERNEL, 0);
+	*pp_store = pp;
 	return 0;
 }
 
-// Return a page to the free list.
+// Return a page to this CPU's magazine.
 // (This function should only be called when pp->pp_ref reaches 0.)
-//
-// Software Engineering Hint: It can be extremely useful for later debugging
-//   if you erase each page's memory as soon as it is freed.  See the Software
-//   Engineering Hint above for reasons why.
 void
 page_free(struct Page *pp)
 {
-    LIST_INSERT_HEAD(&page_free_list, pp, pp_link);
+	struct page_magazine *mag = &page_mags[cpunum()];
+
+	page_uncharge(pp, 0);
+
+	// Magazines feed page_alloc(), which must not hand out high memory.
+	if (page_zone(page2ppn(pp)) == ZONE_HIGH) {
+		spin_lock(&page_lock);
+		buddy_free(pp, 0);
+		spin_unlock(&page_lock);
+		return;
+	}
+	if (mag->n == PAGE_MAG_SIZE)
+		page_mag_drain(mag);
+	mag->pages[mag->n++] = pp;
+}
+
+// Zero one free page into the PAGE_ZERO pool, if the pool isn't full.
+// Called from the idle loop.  Returns 1 if it did some work, else 0.
+int
+page_zero_idle(void)
+{
+	struct Page *pp;
+
+	if (zero_pool_n >= PAGE_ZERO_POOL)
+		return 0;
+
+	spin_lock(&page_lock);
+	pp = buddy_alloc(ZONE_DIRECT, 0);
+	spin_unlock(&page_lock);
+	if (pp == NULL)
+		return 0;
+
+	// Nobody is going to read the page soon; don't let it push
+	// useful data out of the cache.
+	memset_nt(page2kva(pp), 0, PGSIZE);
+
+	spin_lock(&page_lock);
+	if (zero_pool_n < PAGE_ZERO_POOL)
+		zero_pool[zero_pool_n++] = pp;
+	else
+		buddy_free(pp, 0);
+	spin_unlock(&page_lock);
+	return 1;
+}
+
+// Return the number of free pages, wherever they are kept: on the free
+// lists, in the magazines or in the zero pool.
+size_t
+page_nfree(void)
+{
+	int cpu, o;
+	size_t used = 0;
+
+	for (cpu = 0; cpu < NCPU; cpu++)
+		for (o = 0; o < NPGO; o++)
+			used += page_used[cpu][o];
+	return page_ntotal - used;
+}
+
+// Fill in 'st' with how physical memory is being used.
+void
+page_stat(struct page_stat *st)
+{
+	int cpu, o;
+
+	memset(st, 0, sizeof(*st));
+	st->ram = mem_ram_pages;
+	st->boot = mem_ram_pages - page_ntotal;
+	for (o = 0; o < NPGO; o++)
+		for (cpu = 0; cpu < NCPU; cpu++)
+			st->used[o] += page_used[cpu][o];
+	st->free = page_nfree();
+}
+
+// Map a page into the kernel's address space and return its address.
+// Pages in the KERNBASE window are already mapped; a high memory page
+// gets a slot in the kmap window until kunmap().  Slots are few, so
+// don't hold on to them.
+void *
+kmap(struct Page *pp)
+{
+	void *va;
+	int i;
+
+	if (page2ppn(pp) < npages_direct)
+		return page2kva(pp);
+
+	spin_lock(&kmap_lock);
+	for (i = 0; i < NKMAP; i++)
+		if (!(kmap_used[i / 32] & (1 << (i % 32))))
+			break;
+	if (i == NKMAP)
+		panic("kmap: out of slots");
+	kmap_used[i / 32] |= 1 << (i % 32);
+	kmap_ptes[i] = page2pa(pp) | PTE_W | PTE_P;
+	spin_unlock(&kmap_lock);
+
+	va = (void *) (KMAPBASE + i * PGSIZE);
+	tlb_invalidate(kern_pgdir, va);
+	return va;
+}
+
+// Undo kmap().  'va' is the address kmap() returned.
+void
+kunmap(void *va)
+{
+	int i;
+
+	if ((uintptr_t) va >= KERNBASE)
+		return;
+	i = ((uintptr_t) va - KMAPBASE) / PGSIZE;
+	assert(i >= 0 && i < NKMAP && (kmap_used[i / 32] & (1 << (i % 32))));
+
+	spin_lock(&kmap_lock);
+	kmap_ptes[i] = 0;
+	tlb_invalidate(kern_pgdir, va);
+	kmap_used[i / 32] &= ~(1 << (i % 32));
+	spin_unlock(&kmap_lock);
 }
 
 // Decrement the reference count on a page.
@@ -518,12 +1033,18 @@ page_decref(struct Page *pp)
 //
 // Hint: you can turn a Page * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
+//
+// If 'va' is mapped by a 2MB page (PTE_PS), the page directory entry
+// itself is returned.
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
     struct Page *pp;
     pte_t *pte;
 
+    if (pgdir[PDX(va)] & PTE_PS)
+        return &pgdir[PDX(va)];
+
     if (pgdir[PDX(va)] == 0) {
         if (create == 0)
             return NULL;
@@ -571,6 +1092,8 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 
     if (pte == NULL)
         return -E_NO_MEM;
+    if (*pte & PTE_PS)
+        panic("page_insert: %08x is inside a 2MB mapping", va);
 
     // - pp->pp_ref should be incremented if the insertion succeeds.
     pp->pp_ref++;
@@ -608,7 +1131,13 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
         *pte_store = pte;
 
     // Return the page mapped at virtual address 'va'.
-    return &pages[PGNUM(PTE_ADDR(*pte))];
+    // For a 2MB mapping, that is the 4KB page inside it.
+    if (*pte & PTE_PS) {
+        if (PPN(PDE_ADDR_LARGE(*pte)) + PTX(va) >= npages)
+            return NULL;
+        return &pages[PPN(PDE_ADDR_LARGE(*pte)) + PTX(va)];
+    }
+    return &pages[PPN(PTE_ADDR(*pte))];
 }
 
 // Unmaps the physical page at virtual address 'va'.
@@ -635,6 +1164,14 @@ page_remove(pde_t *pgdir, void *va)
     if (pp == NULL)
         return;
 
+    // 2MB mappings are only made by boot_mem_init and hold no page
+    // references: drop the whole mapping.
+    if (*pte_store & PTE_PS) {
+        *pte_store = 0;
+        tlb_invalidate(pgdir, va);
+        return;
+    }
+
     // - The ref count on the physical page should decrement.
     // - The physical page should be freed if the refcount reaches 0.
     page_decref(pp);
@@ -663,11 +1200,17 @@ page_check(void)
 {
 	struct Page *pp, *pp0, *pp1, *pp2;
 	struct Page_list fl;
+	struct page_stat st;
 	pte_t *ptep;
+	uint32_t *va;
+	size_t i, nfree;
+
+	nfree = page_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
 	assert(page_alloc(&pp0) == 0);
+	assert(page_nfree() == nfree - 1);
 	assert(page_alloc(&pp1) == 0);
 	assert(page_alloc(&pp2) == 0);
 
@@ -676,8 +1219,9 @@ page_check(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	LIST_INIT(&fl);
+	while (page_alloc(&pp) == 0)
+		LIST_INSERT_HEAD(&fl, pp, pp_link);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -756,13 +1300,47 @@ page_check(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	while ((pp = LIST_FIRST(&fl)) != NULL) {
+		LIST_REMOVE(pp, pp_link);
+		page_free(pp);
+	}
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
+	// contiguous blocks are aligned to their size and come back zeroed
+	assert(page_alloc_order(&pp, 3, PAGE_ZERO) == 0);
+	assert(page2ppn(pp) % 8 == 0);
+	for (i = 0; i < (PGSIZE << 3) / sizeof(uint32_t); i++)
+		assert(((uint32_t *) page2kva(pp))[i] == 0);
+	page_free_order(pp, 3);
+	assert(page_alloc_order(&pp, PAGE_MAX_ORDER + 1, 0) == -E_INVAL);
+
+	// high memory, if there is any, is mapped by kmap while in use
+	assert(page_alloc_order(&pp, 0, PAGE_HIGH | PAGE_ZERO) == 0);
+	va = kmap(pp);
+	if (page2ppn(pp) >= npages_direct)
+		assert((uintptr_t) va >= KMAPBASE && (uintptr_t) va < KMAPBASE + KMAPSIZE
+		       && check_va2pa(kern_pgdir, (uintptr_t) va) == page2pa(pp));
+	else
+		assert(va == page2kva(pp));
+	for (i = 0; i < PGSIZE / sizeof(uint32_t); i++)
+		assert(va[i] == 0);
+	kunmap(va);
+	if (page2ppn(pp) >= npages_direct)
+		assert(check_va2pa(kern_pgdir, (uintptr_t) va) == ~0);
+	page_free_order(pp, 0);
+
+	// everything went back, and blocks are charged to their owner
+	assert(page_nfree() == nfree);
+	assert(page_alloc_order(&pp, 2, PAGE_OWNER(PGO_EPT)) == 0);
+	page_stat(&st);
+	assert(st.free == nfree - 4 && st.used[PGO_EPT] >= 4);
+	page_free_order(pp, 2);
+	assert(page_nfree() == nfree);
+
 	cprintf("page_check() succeeded!\n");
 }
 
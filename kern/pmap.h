@@ -8,16 +8,20 @@
 #include <inc/memlayout.h>
 #include <inc/assert.h>
 
+// Physical page number of physical address 'pa'.  Unlike PGNUM, this
+// keeps the bits of addresses above 4GB.
+#define PPN(pa)		((ppn_t) ((physaddr_t) (pa) >> PGSHIFT))
+
 // Takes a kernel virtual address 'kva' -- an address that points above
 // KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
 // and returns the corresponding physical address.  Panics if 'kva' is a
 // non-kernel virtual address.
 #define PADDR(kva)						\
 ({								\
-	physaddr_t __m_kva = (physaddr_t) (kva);		\
+	uintptr_t __m_kva = (uintptr_t) (kva);			\
 	if (__m_kva < KERNBASE)					\
 		panic("PADDR called with invalid kva %08lx", __m_kva);\
-	__m_kva - KERNBASE;					\
+	(physaddr_t) (__m_kva - KERNBASE);			\
 })
 
 // Takes a physical address 'pa' and returns the corresponding kernel virtual
@@ -25,19 +29,21 @@
 #define KADDR(pa)						\
 ({								\
 	physaddr_t __m_pa = (pa);				\
-	uint32_t __m_ppn = PGNUM(__m_pa);			\
-	if (__m_ppn >= npages)					\
-		panic("KADDR called with invalid pa %08lx", __m_pa);\
-	(void*) (__m_pa + KERNBASE);				\
+	if (PPN(__m_pa) >= npages_direct)			\
+		panic("KADDR called with invalid pa %08llx", __m_pa);\
+	(void*) ((uintptr_t) __m_pa + KERNBASE);		\
 })
 
 
 // Page structures.
 // The pages[] array keeps track of the state of physical memory.
 // Entry pages[N] holds information about physical page #N.
-// The machine has 'npages' pages of physical memory space.
+// The machine has 'npages' pages of physical memory space, of which the
+// first 'npages_direct' are mapped at KERNBASE.  Pages above that are
+// "high memory", which the kernel reaches through kmap().
 extern struct Page *pages;
 extern size_t npages;
+extern size_t npages_direct;
 
 // Returns the physical page number corresponding to an element of pages[].
 // If pages[N] == pp, then page2ppn(pp) == N.
@@ -52,22 +58,22 @@ page2ppn(struct Page *pp)
 static inline physaddr_t
 page2pa(struct Page *pp)
 {
-	return page2ppn(pp) << PGSHIFT;
+	return (physaddr_t) page2ppn(pp) << PGSHIFT;
 }
 
 // Returns the element of pages[] that contains physical address 'pa'.
-// That is, returns &pages[PGNUM(pa)].
+// That is, returns &pages[PPN(pa)].
 static inline struct Page *
 pa2page(physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
+	if (PPN(pa) >= npages)
 		panic("pa2page called with invalid pa");
-	return &pages[PGNUM(pa)];
+	return &pages[PPN(pa)];
 }
 
 // Returns the starting kernel virtual address corresponding to an element of
 // pages[].  If pages[N] == pp, then page2kva(pp) == KADDR(N*PGSIZE) ==
-// N*PGSIZE + KERNBASE.
+// N*PGSIZE + KERNBASE.  Panics on a high memory page.
 static inline void*
 page2kva(struct Page *pp)
 {
@@ -82,10 +88,44 @@ extern struct Pseudodesc gdt_pd;
 
 void	boot_mem_init(void);
 
+// Physical memory is handed out in blocks of 2^order contiguous pages,
+// aligned to their size.
+#define PAGE_MAX_ORDER	10	// largest block: 1024 pages, 4MB
+
+// page_alloc_order() flags
+#define PAGE_ZERO	0x01	// clear the block's memory
+#define PAGE_HIGH	0x02	// prefer high memory; use kmap() to access it
+#define PAGE_OWNER_SHIFT 8
+#define PAGE_OWNER(o)	((o) << PAGE_OWNER_SHIFT)	// charge the block to 'o'
+
+// Page owners, for accounting.  page_alloc() charges the kernel.
+enum {
+	PGO_KERNEL = 0,
+	PGO_EPT,		// EPT tables
+	PGO_VMX,		// VMXON regions and VMCSs
+	PGO_GUEST,		// guest RAM
+	PGO_DEVICE,		// emulated device memory
+	NPGO
+};
+
+struct page_stat {
+	size_t ram;		// pages of usable RAM
+	size_t boot;		// RAM taken before page_init(): kernel, pages[]
+	size_t free;		// in the allocator
+	size_t used[NPGO];	// allocated, by owner
+};
+
 void	page_init(void);
 void	page_check(void);
 int	page_alloc(struct Page **pp_store);
 void	page_free(struct Page *pp);
+int	page_alloc_order(struct Page **pp_store, int order, int flags);
+void	page_free_order(struct Page *pp, int order);
+int	page_zero_idle(void);
+size_t	page_nfree(void);
+void	page_stat(struct page_stat *st);
+void *	kmap(struct Page *pp);
+void	kunmap(void *va);
 int	page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
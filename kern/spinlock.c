@@ -0,0 +1,37 @@
+// Mutual exclusion spin locks.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <kern/spinlock.h>
+
+void
+__spin_initlock(struct spinlock *lk, const char *name)
+{
+	lk->locked = 0;
+	lk->name = name;
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+void
+spin_lock(struct spinlock *lk)
+{
+	// The xchg is atomic.
+	// It also serializes, so that reads after acquire are not
+	// reordered before it.
+	while (xchg(&lk->locked, 1) != 0)
+		asm volatile ("pause");
+}
+
+// Release the lock.
+void
+spin_unlock(struct spinlock *lk)
+{
+	if (!lk->locked)
+		panic("spin_unlock: %s is not held", lk->name);
+
+	// The xchg serializes, so that reads before release are
+	// not reordered after it.
+	xchg(&lk->locked, 0);
+}
@@ -47,6 +47,8 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
+		return "Hardware Interrupt";
 
 	return "(unknown trap)";
 }
@@ -78,6 +80,9 @@ idt_init(void)
     extern uint32_t handler17;// aligment check
     extern uint32_t handler18;// machine check
     extern uint32_t handler19;// SIMD floating point error
+    extern uint32_t handler33;// keyboard
+    extern uint32_t handler36;// serial port
+    extern uint32_t handler39;// spurious
     extern uint32_t handler48;// System Call
 
     SETGATE(idt[1],1,GD_KT,&handler1,0);
@@ -100,6 +105,12 @@ idt_init(void)
     SETGATE(idt[18],1,GD_KT,&handler18,0);
     SETGATE(idt[19],1,GD_KT,&handler19,0);
 
+	// Device interrupts use interrupt gates, so that they run with
+	// interrupts off.
+    SETGATE(idt[IRQ_OFFSET+IRQ_KBD],0,GD_KT,&handler33,0);
+    SETGATE(idt[IRQ_OFFSET+IRQ_SERIAL],0,GD_KT,&handler36,0);
+    SETGATE(idt[IRQ_OFFSET+IRQ_SPURIOUS],0,GD_KT,&handler39,0);
+
 	// Set a gate for the system call interrupt.
 	// Hint: Must this gate be accessible from userlevel?
 	// LAB 3: Your code here.
@@ -163,6 +174,20 @@ trap(struct Trapframe *tf)
         monitor(tf);
         break;
 
+	case IRQ_OFFSET + IRQ_KBD:
+		kbd_intr();
+		break;
+
+	case IRQ_OFFSET + IRQ_SERIAL:
+		serial_intr();
+		break;
+
+	// Handle spurious interrupts
+	// The hardware sometimes raises these because of noise on the
+	// IRQ line or other reasons. We don't care.
+	case IRQ_OFFSET + IRQ_SPURIOUS:
+		break;
+
 	default:
 		// Unexpected trap: The user process or the kernel has a bug.
 		print_trapframe(tf);
@@ -27,6 +27,7 @@ static const char * const error_string[MAXERROR + 1] =
 	"out of memory",
 	"out of environments",
 	"segmentation fault",
+	"operation not supported",
 };
 
 /*